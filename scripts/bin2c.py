@@ -0,0 +1,20 @@
+#!/usr/bin/env python3
+#
+# Emit a binary file (e.g. a cyphertext in data/cypher-*.txt) as the body of a
+# C byte-array initializer, to be #include'd between braces.
+#
+# usage: bin2c.py data/cypher-wiki-128.txt > data/cyphertext.txt
+
+import sys
+
+COLS = 16
+
+
+def main():
+    data = open(sys.argv[1], 'rb').read()
+    for i in range(0, len(data), COLS):
+        print(','.join('0x%02x' % b for b in data[i:i + COLS]) + ',')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+#
+# Expand the deferred log of src/main.c (built with CONFIG_LOG_DEFERRED and a
+# CONFIG_LOG_LEVEL above 0): the records in a dump of the log_ring variable
+# are formatted with the format strings from the log_fmt section of the ELF.
+# A task cut by a power failure runs again, with the same sequence number, and
+# logs again: only the records of its last execution are kept.
+#
+# usage: dlog.py main.out              (where log_ring is, and how to dump it)
+#        dlog.py main.out ring.bin     (the log, oldest record first)
+
+import re
+import struct
+import sys
+
+RECORD_HEADER_BYTES = 6
+RECORD_FIRST = 0x80
+CONVERSION = re.compile(r'%[-+ #0]*\d*(?:\.\d+)?(?:hh|h|ll|l)?([diuxXoc%])')
+
+
+class Elf:
+    def __init__(self, data):
+        if data[:4] != b'\x7fELF':
+            sys.exit('error: not an ELF file')
+        self.data = data
+        self.is64 = data[4] == 2
+        e = '<' if data[5] == 1 else '>'
+        self.e = e
+        if self.is64:
+            shoff, = struct.unpack_from(e + 'Q', data, 0x28)
+            shentsize, shnum, shstrndx = struct.unpack_from(e + 'HHH', data, 0x3A)
+        else:
+            shoff, = struct.unpack_from(e + 'I', data, 0x20)
+            shentsize, shnum, shstrndx = struct.unpack_from(e + 'HHH', data, 0x2E)
+        self.sections = []
+        for i in range(shnum):
+            off = shoff + i * shentsize
+            if self.is64:
+                name, stype, _, addr, offset, size, link, _, _, entsize = \
+                    struct.unpack_from(e + 'IIQQQQIIQQ', data, off)
+            else:
+                name, stype, _, addr, offset, size, link, _, _, entsize = \
+                    struct.unpack_from(e + 'IIIIIIIIII', data, off)
+            self.sections.append(dict(name=name, type=stype, addr=addr, offset=offset,
+                                      size=size, link=link, entsize=entsize))
+        names = self.sections[shstrndx]
+        for s in self.sections:
+            s['name'] = self.string(names, s['name'])
+
+    def string(self, section, offset):
+        start = section['offset'] + offset
+        return self.data[start:self.data.index(b'\0', start)].decode()
+
+    def section(self, name):
+        for s in self.sections:
+            if s['name'] == name:
+                return s
+        return None
+
+    def contents(self, section):
+        return self.data[section['offset']:section['offset'] + section['size']]
+
+    def symbol(self, name):
+        symtab = self.section('.symtab')
+        if symtab is None:
+            return None
+        strtab = self.sections[symtab['link']]
+        fmt = self.e + ('IBBHQQ' if self.is64 else 'IIIBBH')
+        for off in range(0, symtab['size'], symtab['entsize']):
+            fields = struct.unpack_from(fmt, self.data, symtab['offset'] + off)
+            if self.is64:
+                sname, _, _, _, value, size = fields
+            else:
+                sname, value, size, _, _, _ = fields
+            if self.string(strtab, sname) == name:
+                return value, size
+        return None
+
+
+def expand(fmt, args):
+    out = []
+    pos = 0
+    args = list(args)
+    for m in CONVERSION.finditer(fmt):
+        out.append(fmt[pos:m.start()])
+        pos = m.end()
+        conv = m.group(1)
+        if conv == '%':
+            out.append('%')
+            continue
+        value, width = args.pop(0) if args else (0, 2)
+        if conv in 'di' and value >= 1 << (8 * width - 1):
+            value -= 1 << (8 * width)
+        spec = re.sub(r'(hh|h|ll|l)', '', m.group(0))
+        out.append(spec.replace('u', 'd').replace('i', 'd') % value)
+    out.append(fmt[pos:])
+    return ''.join(out)
+
+
+def records(ring):
+    size = len(ring) - 4
+    head, first = struct.unpack_from('<HH', ring, size)
+    byte = lambda i: ring[i % 0x10000 % size]
+    pos = first
+    while (head - pos) % 0x10000 >= RECORD_HEADER_BYTES:
+        id = byte(pos) | byte(pos + 1) << 8
+        time = byte(pos + 2) | byte(pos + 3) << 8
+        nargs, wide = byte(pos + 4), byte(pos + 5)
+        pos += RECORD_HEADER_BYTES
+        args = []
+        for i in range(nargs & ~RECORD_FIRST):
+            width = 4 if wide >> i & 1 else 2
+            args.append((sum(byte(pos + j) << (8 * j) for j in range(width)), width))
+            pos += width
+        yield time, bool(nargs & RECORD_FIRST), id, args
+
+
+def executions(records):
+    # Records grouped by task execution; an execution followed by another of
+    # the same task sequence number was cut by a power failure, and dropped
+    runs = []
+    for time, first, id, args in records:
+        if first or not runs:
+            if runs and runs[-1][0] == time:
+                sys.stdout.write('<power failure: %u records of task %u dropped>\n'
+                                 % (len(runs[-1][1]), time))
+                runs.pop()
+            runs.append((time, []))
+        runs[-1][1].append((id, args))
+    for time, run in runs:
+        for id, args in run:
+            yield id, args
+
+
+def main():
+    elf = Elf(open(sys.argv[1], 'rb').read())
+    ring_sym = elf.symbol('log_ring')
+    fmt_section = elf.section('log_fmt')
+    if ring_sym is None or fmt_section is None:
+        sys.exit('error: no deferred log in %s' % sys.argv[1])
+
+    if len(sys.argv) < 3:
+        addr, size = ring_sym
+        print('log_ring: 0x%x, %u bytes; e.g.: mspdebug tilib "save_raw 0x%x %u ring.bin"'
+              % (addr, size, addr, size))
+        return
+
+    strings = elf.contents(fmt_section)
+    ring = open(sys.argv[2], 'rb').read()
+    for id, args in executions(records(ring)):
+        end = strings.find(b'\0', id)
+        if id >= len(strings) or end < 0:
+            sys.stdout.write('<bad record: id %u>\n' % id)
+            continue
+        sys.stdout.write(expand(strings[id:end].decode(errors='replace'), args).replace('\r', ''))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+#
+# Decode the binary output frames of src/main.c (captured from the UART) into
+# the cyphertext as a binary file, in the format of data/cypher-*.txt. Bytes
+# outside of valid frames (console text, line noise) are skipped; a block
+# received more than once, after a power failure, counts once.
+#
+# usage: frames2bin.py capture.bin > data/cypher-wiki-128.txt
+
+import struct
+import sys
+
+SYNC = 0x7E
+HEADER_BYTES = 6
+CRC_BYTES = 2
+
+KEY = 0x01
+BLOCK = 0x02
+END = 0x03
+BENCH = 0x04
+
+
+def crc16_ccitt(data):
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021 if crc & 0x8000 else crc << 1) & 0xFFFF
+    return crc
+
+
+def frames(data):
+    i = 0
+    while i + HEADER_BYTES + CRC_BYTES <= len(data):
+        if data[i] != SYNC:
+            i += 1
+            continue
+        ftype, seq, length = struct.unpack_from('<BHH', data, i + 1)
+        end = i + HEADER_BYTES + length
+        if end + CRC_BYTES > len(data):
+            i += 1
+            continue
+        crc, = struct.unpack_from('<H', data, end)
+        if crc != crc16_ccitt(data[i + 1:end]):
+            i += 1
+            continue
+        yield ftype, seq, data[i + HEADER_BYTES:end]
+        i = end + CRC_BYTES
+
+
+def main():
+    data = open(sys.argv[1], 'rb').read() if len(sys.argv) > 1 else sys.stdin.buffer.read()
+    blocks = {}
+    length = None
+    for ftype, seq, payload in frames(data):
+        if ftype == KEY:
+            size = len(payload) // 2  # exponent and N, of the same width
+            e = int.from_bytes(payload[:size], 'little')
+            n = int.from_bytes(payload[size:], 'little')
+            sys.stderr.write('key: e = 0x%x, N = 0x%x\n' % (e, n))
+        elif ftype == BLOCK:
+            blocks[seq] = payload
+        elif ftype == END:
+            length, = struct.unpack_from('<H', payload)
+            nblocks = seq
+        elif ftype == BENCH:
+            sys.stderr.write('cycles: %u\n' % int.from_bytes(payload[:6], 'little'))
+            if len(payload) > 6:
+                wait = int.from_bytes(payload[6:10], 'little')
+                sys.stderr.write('cycles waiting for the output ring: %u\n' % wait)
+
+    if length is None:
+        sys.exit('error: no end frame: output incomplete')
+    missing = [i for i in range(nblocks) if i not in blocks]
+    if missing:
+        sys.exit('error: blocks missing: %s' % ', '.join(map(str, missing)))
+
+    cyphertext = b''.join(blocks[i] for i in range(nblocks))
+    if len(cyphertext) != length:
+        sys.exit('error: length %u, expected %u' % (len(cyphertext), length))
+    sys.stdout.buffer.write(cyphertext)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+#
+# Wrap a public key (a pubkey_t initializer, as in data/key*.txt) into the
+# provisioning frame of the key store of src/main.c: send it to the console
+# UART to make it the current key, or, on a host build, save it as key.frame.
+#
+# usage: key2frame.py data/key128.txt > /dev/ttyUSB0
+#        key2frame.py data/key128.txt > key.frame
+
+import re
+import struct
+import sys
+
+SYNC = 0x7E
+KEY_PROVISION = 0x10
+
+
+def crc16_ccitt(data):
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021 if crc & 0x8000 else crc << 1) & 0xFFFF
+    return crc
+
+
+def c_array(text, name):
+    return bytes(int(x, 16) for x in re.search(r'\.%s\s*=\s*\{([^}]*)\}' % name, text).group(1).split(',')
+                 if x.strip())
+
+
+def parse(text):
+    n = c_array(text, 'n')
+    e = int.from_bytes(c_array(text, 'e'), 'little')
+    return n, e
+
+
+# The payload is the exponent and N, both of the width of N, LSB first
+def frame(n, e):
+    payload = e.to_bytes(len(n), 'little') + n
+    body = struct.pack('<BHH', KEY_PROVISION, 0, len(payload)) + payload
+    return bytes([SYNC]) + body + struct.pack('<H', crc16_ccitt(body))
+
+
+def main():
+    n, e = parse(open(sys.argv[1]).read())
+    if not n[0] & 1 or n[-1] < 0x80:
+        sys.exit('error: the modulus must be odd, with its top byte at least 0x80')
+    sys.stdout.buffer.write(frame(n, e))
+
+
+if __name__ == '__main__':
+    main()
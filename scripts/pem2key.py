@@ -0,0 +1,192 @@
+#!/usr/bin/env python3
+#
+# Import an RSA key from PEM or DER (PKCS#1 or PKCS#8 private key, PKCS#1 or
+# X.509 SubjectPublicKeyInfo public key, as made by openssl genrsa/rsa) into
+# the formats of src/main.c, with all numbers LSB first:
+#
+#   pub      pubkey_t initializer (data/key*.txt)
+#   priv     privkey_t initializer with the CRT parameters (data/privkey*.txt)
+#   frame    provisioning frame for the key store (see scripts/key2frame.py)
+#   records  key_record initializers for CONFIG_KEY_RECORDS (data/keyrec.txt):
+#            the digits of the modulus and the constants of the reduction,
+#            for the build given by --digit-bits, --reduce and --decrypt
+#
+# usage: pem2key.py pub data/private128.pem > data/key128.txt
+#        pem2key.py priv data/private128.pem > data/privkey128.txt
+#        pem2key.py frame data/private128.pem > /dev/ttyUSB0
+#        pem2key.py records --reduce BARRETT data/private128.pem > data/keyrec.txt
+
+import argparse
+import base64
+import re
+import sys
+
+from key2frame import frame
+
+REDUCE = {'SCHOOLBOOK': 0, 'MONTGOMERY': 1, 'BARRETT': 2}
+
+INTEGER = 0x02
+BIT_STRING = 0x03
+OCTET_STRING = 0x04
+SEQUENCE = 0x30
+
+
+def der_read(data, pos=0):
+    tag = data[pos]
+    length = data[pos + 1]
+    pos += 2
+    if length & 0x80:
+        nbytes = length & 0x7f
+        length = int.from_bytes(data[pos:pos + nbytes], 'big')
+        pos += nbytes
+    if pos + length > len(data):
+        sys.exit('error: truncated DER')
+    return tag, data[pos:pos + length], pos + length
+
+
+def der_items(data):
+    pos = 0
+    while pos < len(data):
+        tag, value, pos = der_read(data, pos)
+        yield tag, value
+
+
+def der_sequence(data):
+    tag, value, _ = der_read(data)
+    if tag != SEQUENCE:
+        sys.exit('error: not a DER sequence')
+    return list(der_items(value))
+
+
+def integers(items):
+    return [int.from_bytes(v, 'big') for t, v in items if t == INTEGER]
+
+
+def parse(data):
+    if data.lstrip().startswith(b'-----'):
+        m = re.search(rb'-----BEGIN ([A-Z ]+)-----(.*?)-----END', data, re.S)
+        data = base64.b64decode(b''.join(m.group(2).split()))
+
+    items = der_sequence(data)
+    tags = [t for t, _ in items]
+    if tags[:2] == [INTEGER, SEQUENCE] and OCTET_STRING in tags:  # PKCS#8
+        return parse(dict(items)[OCTET_STRING])
+    if tags[:2] == [SEQUENCE, BIT_STRING]:  # SubjectPublicKeyInfo
+        return parse(dict(items)[BIT_STRING][1:])  # skip the unused bit count
+
+    values = integers(items)
+    if len(values) == 2:  # RSAPublicKey
+        n, e = values
+        return dict(n=n, e=e)
+    if len(values) == 9 and values[0] == 0:  # RSAPrivateKey, two primes
+        _, n, e, d, p, q, dp, dq, qinv = values
+        if p < q:  # the CRT recombination wants p > q
+            p, q, dp, dq = q, p, dq, dp
+            qinv = pow(q, -1, p)
+        return dict(n=n, e=e, d=d, p=p, q=q, dp=dp, dq=dq, qinv=qinv)
+    sys.exit('error: not an RSA key (multi-prime keys are not supported)')
+
+
+def c_bytes(x, size):
+    return '{ ' + ','.join('0x%02x' % b for b in x.to_bytes(size, 'little')) + ' }'
+
+
+def c_digits(x, count, bits):
+    width = bits // 4
+    mask = (1 << bits) - 1
+    return '{ ' + ','.join('0x%0*x' % (width, x >> (bits * i) & mask)
+                           for i in range(count)) + ' }'
+
+
+# Same as key_hash() in src/main.c
+def key_hash(modulus, size, digit_bits, reduce):
+    bits = 8 * size
+    h = 2166136261
+    for b in bytes([bits >> 8, bits & 0xff, digit_bits, reduce]) + modulus.to_bytes(size, 'little'):
+        h = ((h ^ b) * 16777619) & 0xffffffff
+    return h
+
+
+# Same as key_setup() in src/main.c
+def key_record(modulus, size, digit_bits, reduce):
+    k = 8 * size // digit_bits
+    b = 1 << digit_bits
+    fields = [('valid', 'true'),
+              ('hash', '0x%08x' % key_hash(modulus, size, digit_bits, reduce)),
+              ('n', c_digits(modulus, k, digit_bits))]
+    if reduce == REDUCE['SCHOOLBOOK']:
+        n_div = modulus >> (digit_bits * (k - 2))
+        fields += [('n_div', '0x%x' % n_div),
+                   ('n_recip', '0x%x' % (((b ** 3 - 1) // n_div - b) & (b - 1)))]
+    elif reduce == REDUCE['MONTGOMERY']:
+        fields += [('n_prime', '0x%x' % (-pow(modulus, -1, b) % b)),
+                   ('R2_mod_N', c_digits(b ** (2 * k) % modulus, k, digit_bits))]
+    else:
+        fields += [('mu', c_digits(b ** (2 * k) // modulus, k + 1, digit_bits))]
+    return '{\n' + ',\n'.join('    .%s = %s' % f for f in fields) + '\n},'
+
+
+def records(key, size, args):
+    reduce = REDUCE[args.reduce]
+    if args.decrypt:
+        if 'p' not in key:
+            sys.exit('error: decryption needs the private key')
+        size //= 2
+        moduli = [key['p'], key['q']]  # in the order of CRT_P, CRT_Q
+    else:
+        moduli = [key['n']]
+
+    print('// Key records for %u-bit moduli, %u-bit digits, %s reduction: see scripts/pem2key.py'
+          % (8 * size, args.digit_bits, args.reduce.lower()))
+    print('#if (CONFIG_KEY_SIZE_RUNTIME ? MODULUS_MAX_BITS < %u : MODULUS_MAX_BITS != %u) || \\'
+          % (8 * size, 8 * size))
+    print('    DIGIT_BITS != %u || CONFIG_REDUCE != REDUCE_%s || NUM_KEY_RECORDS != %u'
+          % (args.digit_bits, args.reduce, len(moduli)))
+    print('#error The key records (CONFIG_KEY_RECORDS) were made for another build')
+    print('#endif')
+    for m in moduli:
+        print(key_record(m, size, args.digit_bits, reduce))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Import an RSA key for src/main.c')
+    parser.add_argument('output', choices=['pub', 'priv', 'frame', 'records'])
+    parser.add_argument('key', help='PEM or DER file')
+    parser.add_argument('--digit-bits', type=int, choices=[8, 16], default=8)
+    parser.add_argument('--reduce', choices=sorted(REDUCE), default='MONTGOMERY')
+    parser.add_argument('--decrypt', action='store_true',
+                        help='records for the two primes, as in CONFIG_DECRYPT')
+    args = parser.parse_args()
+
+    key = parse(open(args.key, 'rb').read())
+    size = (key['n'].bit_length() + 7) // 8
+    if not key['n'] & 1 or key['n'] >> (8 * size - 8) < 0x80:
+        sys.exit('error: the modulus must be odd, with its top byte at least 0x80')
+    if 8 * size % (2 * args.digit_bits if args.decrypt else args.digit_bits):
+        sys.exit('error: the modulus is not a whole number of digits')
+    half = size // 2
+    if 'p' in key and key['p'] >> (8 * half):
+        sys.exit('error: the primes are longer than half the modulus')
+
+    if args.output == 'pub':
+        print('// modulus: byte order: LSB to MSB, constraint MSB>=0x80')
+        print('.n = %s,' % c_bytes(key['n'], size))
+        print('.e = %s' % c_bytes(key['e'], (key['e'].bit_length() + 7) // 8))
+    elif args.output == 'priv':
+        if 'p' not in key:
+            sys.exit('error: not a private key')
+        print('// modulus: byte order: LSB to MSB, constraint MSB>=0x80')
+        print('.n = %s,' % c_bytes(key['n'], size))
+        print('.e = %s,' % c_bytes(key['e'], (key['e'].bit_length() + 7) // 8))
+        print('// CRT parameters: byte order: LSB to MSB')
+        for name in ['p', 'q', 'dp', 'dq']:
+            print('.%s = %s,' % (name, c_bytes(key[name], half)))
+        print('.qinv = %s' % c_bytes(key['qinv'], half))
+    elif args.output == 'frame':
+        sys.stdout.buffer.write(frame(key['n'].to_bytes(size, 'little'), key['e']))
+    else:
+        records(key, size, args)
+
+
+if __name__ == '__main__':
+    main()
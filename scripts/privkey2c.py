@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+#
+# Convert an RSA private key dump (output of `openssl rsa -text -noout`, as in
+# data/private*.txt) into a privkey_t initializer for src/main.c: all numbers
+# LSB first, the CRT parameters padded to half the modulus size.
+#
+# usage: privkey2c.py data/private128.txt > data/privkey128.txt
+
+import re
+import sys
+
+FIELDS = ['modulus', 'publicExponent', 'prime1', 'prime2',
+          'exponent1', 'exponent2', 'coefficient']
+
+
+def parse(text):
+    values = {}
+    name = None
+    for line in text.splitlines():
+        if line.startswith('-----'):
+            break
+        m = re.match(r'^(\w+):\s*(.*)$', line)
+        if m:
+            name = m.group(1)
+            rest = m.group(2)
+            single = re.match(r'^(\d+)\s*\(0x[0-9a-fA-F]+\)$', rest)
+            if single:
+                values[name] = int(single.group(1))
+                name = None
+            else:
+                values[name] = ''
+        elif name is not None:
+            values[name] += line.strip()
+    for k, v in values.items():
+        if isinstance(v, str):
+            values[k] = int(v.replace(':', ''), 16) if v else 0
+    return values
+
+
+def c_bytes(x, size):
+    return '{ ' + ','.join('0x%02x' % b for b in x.to_bytes(size, 'little')) + ' }'
+
+
+def main():
+    key = parse(open(sys.argv[1]).read())
+    missing = [f for f in FIELDS if f not in key]
+    if missing:
+        sys.exit('missing fields: ' + ', '.join(missing))
+
+    size = (key['modulus'].bit_length() + 7) // 8
+    half = size // 2
+
+    print('// modulus: byte order: LSB to MSB, constraint MSB>=0x80')
+    print('.n = %s,' % c_bytes(key['modulus'], size))
+    e = key['publicExponent']
+    print('.e = %s,' % c_bytes(e, (e.bit_length() + 7) // 8))
+    print('// CRT parameters: byte order: LSB to MSB')
+    print('.p = %s,' % c_bytes(key['prime1'], half))
+    print('.q = %s,' % c_bytes(key['prime2'], half))
+    print('.dp = %s,' % c_bytes(key['exponent1'], half))
+    print('.dq = %s,' % c_bytes(key['exponent2'], half))
+    print('.qinv = %s' % c_bytes(key['coefficient'], half))
+
+
+if __name__ == '__main__':
+    main()
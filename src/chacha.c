@@ -0,0 +1,55 @@
+#include <stdint.h>
+
+#include "chacha.h"
+
+#define CHACHA_ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define CHACHA_QR(x, a, b, c, d) do { \
+    x[a] += x[b]; x[d] ^= x[a]; x[d] = CHACHA_ROTL(x[d], 16); \
+    x[c] += x[d]; x[b] ^= x[c]; x[b] = CHACHA_ROTL(x[b], 12); \
+    x[a] += x[b]; x[d] ^= x[a]; x[d] = CHACHA_ROTL(x[d], 8); \
+    x[c] += x[d]; x[b] ^= x[c]; x[b] = CHACHA_ROTL(x[b], 7); \
+} while (0)
+
+static uint32_t load32_le(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void chacha_block(uint8_t *out, const uint8_t *key, uint32_t counter,
+                  const uint8_t *nonce)
+{
+    int i;
+    uint32_t s[16], x[16];
+
+    s[0] = 0x61707865; // "expand 32-byte k"
+    s[1] = 0x3320646e;
+    s[2] = 0x79622d32;
+    s[3] = 0x6b206574;
+    for (i = 0; i < 8; ++i)
+        s[4 + i] = load32_le(&key[4 * i]);
+    s[12] = counter;
+    for (i = 0; i < 3; ++i)
+        s[13 + i] = load32_le(&nonce[4 * i]);
+
+    for (i = 0; i < 16; ++i)
+        x[i] = s[i];
+    for (i = 0; i < 10; ++i) { // column rounds, then diagonal rounds
+        CHACHA_QR(x, 0, 4,  8, 12);
+        CHACHA_QR(x, 1, 5,  9, 13);
+        CHACHA_QR(x, 2, 6, 10, 14);
+        CHACHA_QR(x, 3, 7, 11, 15);
+        CHACHA_QR(x, 0, 5, 10, 15);
+        CHACHA_QR(x, 1, 6, 11, 12);
+        CHACHA_QR(x, 2, 7,  8, 13);
+        CHACHA_QR(x, 3, 4,  9, 14);
+    }
+
+    for (i = 0; i < 16; ++i) {
+        x[i] += s[i];
+        out[4 * i] = x[i];
+        out[4 * i + 1] = x[i] >> 8;
+        out[4 * i + 2] = x[i] >> 16;
+        out[4 * i + 3] = x[i] >> 24;
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef CHACHA_H
+#define CHACHA_H
+
+#include <stdint.h>
+
+#define CHACHA_KEY_BYTES   32
+#define CHACHA_NONCE_BYTES 12
+#define CHACHA_BLOCK_BYTES 64
+
+// One 64-byte block of ChaCha20 keystream (RFC 8439): 256-bit key, 32-bit
+// block counter, 96-bit nonce
+void chacha_block(uint8_t *out, const uint8_t *key, uint32_t counter,
+                  const uint8_t *nonce);
+
+#endif // CHACHA_H
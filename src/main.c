@@ -3,7 +3,9 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <libio/log.h>
 #include <libmsp/mem.h>
@@ -17,28 +19,391 @@
 #endif
 
 #include "pins.h"
+#include "chacha.h"
 
 // #define VERBOSE
 
 #include "../data/keysize.h"
 
-#define DIGIT_BITS       8 // arithmetic ops take 8-bit args produce 16-bit result
+// Decryption (1) of CYPHERTEXT with the private key, by the Chinese Remainder
+// Theorem: all modular arithmetic is modulo one of the primes, i.e. at half
+// the key size. Encryption of PLAINTEXT with the public key (0, default).
+#ifndef CONFIG_DECRYPT
+#define CONFIG_DECRYPT 0
+#endif
+
+// Key size at run time (1): KEY_SIZE_BITS is then the largest key, which
+// sizes the channels and buffers, and the size of each key is found from its
+// modulus in task_init, so that one image takes any of data/key*.txt up to
+// KEY_SIZE_BITS and the loops run over the digits of the key only. The
+// modulus must be a whole number of digits (of each prime, when decrypting),
+// and at least two. Otherwise (0, default) every key is of KEY_SIZE_BITS.
+#ifndef CONFIG_KEY_SIZE_RUNTIME
+#define CONFIG_KEY_SIZE_RUNTIME 0
+#endif
+
+#if CONFIG_DECRYPT
+#define MODULUS_MAX_BITS (KEY_SIZE_BITS / 2)
+#else
+#define MODULUS_MAX_BITS KEY_SIZE_BITS
+#endif
+
+// Hybrid encryption (1): only a session key and nonce, drawn in task_init
+// from clock jitter, are encrypted with RSA, and PLAINTEXT is encrypted with
+// ChaCha20 under them, one 64-byte keystream block per task. The cyphertext
+// is the RSA blocks of the session (the key, then the nonce) followed by the
+// ChaCha20 cyphertext of the message.
+#ifndef CONFIG_HYBRID
+#define CONFIG_HYBRID 0
+#endif
+
+#if CONFIG_HYBRID && CONFIG_DECRYPT
+#error The hybrid mode (CONFIG_HYBRID) is for encryption only
+#endif
+
+// Compression (1) of PLAINTEXT before it is split into RSA blocks, by an
+// LZSS pre-pass that looks back up to CONFIG_COMPRESS_WINDOW bytes (a power
+// of two, at most 2048). The history is PLAINTEXT itself, in FRAM. The
+// compressed message starts with the original length, and the decryption
+// mode (built with the same setting) restores the original. Compressible
+// text takes fewer blocks, and so fewer modular exponentiations, but the
+// match search costs cycles of its own: whether it pays off on the target is
+// measured by comparing the CONFIG_BENCH reports of builds with and without.
+#ifndef CONFIG_COMPRESS
+#define CONFIG_COMPRESS 0
+#endif
+
+#ifndef CONFIG_COMPRESS_WINDOW
+#define CONFIG_COMPRESS_WINDOW 1024
+#endif
+
+#if CONFIG_COMPRESS
+#if CONFIG_HYBRID
+#error Compression (CONFIG_COMPRESS) applies to RSA blocks, not to the hybrid mode
+#endif
+#if CONFIG_COMPRESS_WINDOW > 2048 || (CONFIG_COMPRESS_WINDOW & (CONFIG_COMPRESS_WINDOW - 1))
+#error CONFIG_COMPRESS_WINDOW must be a power of two of at most 2048
+#endif
+#endif
+
+// Streaming input (1): the message is received on the console UART (on a
+// host build, read from stdin) into a ring of CONFIG_STREAM_RING_BYTES in
+// FRAM, and ends with an EOT byte (0x04) or end of file, instead of being
+// the compiled-in PLAINTEXT. The sender is paused by XOFF/XON while the ring
+// is full. The message length is not bounded by memory, since the blocks of
+// cyphertext are printed as they are done, but by the 16-bit offsets and
+// lengths (as in the FRAME_END length): the cyphertext is at most 64 KiB, so
+// the message is at most STREAM_MAX_BLOCKS blocks (61425 bytes with a 128-bit
+// key), and a longer one stops with an error.
+#ifndef CONFIG_STREAM_INPUT
+#define CONFIG_STREAM_INPUT 0
+#endif
+
+#ifndef CONFIG_STREAM_RING_BYTES
+#define CONFIG_STREAM_RING_BYTES 512
+#endif
+
+#if CONFIG_STREAM_INPUT
+#if CONFIG_DECRYPT || CONFIG_HYBRID || CONFIG_COMPRESS
+#error Streaming input (CONFIG_STREAM_INPUT) is for plain RSA encryption only
+#endif
+#if CONFIG_STREAM_RING_BYTES & (CONFIG_STREAM_RING_BYTES - 1)
+#error CONFIG_STREAM_RING_BYTES must be a power of two
+#endif
+#endif
+
+// Output of the encryption: binary frames (0, default), decoded on the host
+// by scripts/frames2bin.py, or lines of hex (1). Streaming input needs the
+// hex: its XON/XOFF flow control shares the UART, and a sender's tty strips
+// those bytes wherever they occur.
+#ifndef CONFIG_OUTPUT_HEX
+#define CONFIG_OUTPUT_HEX CONFIG_STREAM_INPUT
+#endif
+
+#if CONFIG_STREAM_INPUT && !CONFIG_OUTPUT_HEX
+#error Streaming input (CONFIG_STREAM_INPUT) needs hex output (CONFIG_OUTPUT_HEX)
+#endif
+
+// Frames are queued in a ring of CONFIG_OUTPUT_RING_BYTES in FRAM, which the
+// UART interrupt drains while the tasks go on computing. With CONFIG_BENCH,
+// the cycles that the tasks spend waiting for room in the ring are reported:
+// the rest of the transmission overlapped the computation.
+//
+// Only frames go through the ring. A frame cut by a power failure is sent
+// again from its start, which the receiver can tell from its header and CRC,
+// while text cannot be resent without duplicates. So the hex output, which
+// is for streaming input and debugging, is printed and waited for, and so is
+// the text of the binary mode: the immediate log (CONFIG_LOG_DEFERRED=0)
+// first waits for the ring to drain, so as not to cut into a frame on the
+// wire, and an error message, after which the device halts, may cut into the
+// frame in flight, which frames2bin.py then drops with the rest of the
+// incomplete output.
+#ifndef CONFIG_OUTPUT_RING_BYTES
+#if KEY_SIZE_BITS > 1024 // for the key frame
+#define CONFIG_OUTPUT_RING_BYTES 1024
+#else
+#define CONFIG_OUTPUT_RING_BYTES 512
+#endif
+#endif
+
+#if CONFIG_OUTPUT_RING_BYTES & (CONFIG_OUTPUT_RING_BYTES - 1)
+#error CONFIG_OUTPUT_RING_BYTES must be a power of two
+#endif
+
+// Store of public keys (1, default when encrypting): keys are provisioned at
+// run time into CONFIG_KEY_SLOTS slots in FRAM, by a frame on the console UART
+// (on a host build, from the file CONFIG_KEY_FILE at boot), and each message
+// is encrypted with the newest slot that passes its checksum. Without a valid
+// slot, the compiled-in key is used. Streaming input takes the receiver of
+// the UART, so it goes without the store.
+#ifndef CONFIG_KEY_STORE
+#define CONFIG_KEY_STORE (!CONFIG_DECRYPT && !CONFIG_STREAM_INPUT)
+#endif
+
+#ifndef CONFIG_KEY_SLOTS
+#define CONFIG_KEY_SLOTS 2
+#endif
+
+#ifndef CONFIG_KEY_FILE
+#define CONFIG_KEY_FILE "key.frame"
+#endif
+
+#if CONFIG_KEY_STORE
+#if CONFIG_DECRYPT
+#error The key store (CONFIG_KEY_STORE) holds public keys, for encryption
+#endif
+#if CONFIG_STREAM_INPUT
+#error The key store (CONFIG_KEY_STORE) and streaming input share the UART receiver
+#endif
+#if CONFIG_KEY_SLOTS < 2
+#error The key store needs two slots, so that a new key never overwrites the newest
+#endif
+#endif
+
+// Precomputed key records (1): the reduction constants of the compiled-in key
+// come with the image, from data/keyrec.txt made by scripts/pem2key.py, and
+// the first boot skips the key setup. Records of another key, e.g. one from
+// the key store, fail the hash check and are set up at run time as usual.
+#ifndef CONFIG_KEY_RECORDS
+#define CONFIG_KEY_RECORDS 0
+#endif
+
+// Benchmark (1): the cycles of each message, from task_init to the end of the
+// output, are counted on Timer_A0 from SMCLK and reported last (a FRAME_BENCH
+// frame, or a line of the hex output). Meaningful under continuous power
+// only, since a reboot restarts the count. On a host build, clock() ticks.
+#ifndef CONFIG_BENCH
+#define CONFIG_BENCH 0
+#endif
+
+// Log sites at or below CONFIG_LOG_LEVEL are compiled in, the others are
+// empty: 0 none (default), 1 per message and block (LOG_INFO), 2 per task
+// (LOG_DEBUG), 3 per digit (LOG_TRACE).
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_DEBUG 2
+#define LOG_LEVEL_TRACE 3
+
+#ifndef CONFIG_LOG_LEVEL
+#define CONFIG_LOG_LEVEL LOG_LEVEL_NONE
+#endif
+
+// Deferred logging (1, default): a site appends its ID and raw arguments to a
+// ring of CONFIG_LOG_RING_BYTES in FRAM, which scripts/dlog.py expands with
+// the format strings from the ELF. Otherwise (0) sites format through LOG.
+#ifndef CONFIG_LOG_DEFERRED
+#define CONFIG_LOG_DEFERRED 1
+#endif
+
+#ifndef CONFIG_LOG_RING_BYTES
+#define CONFIG_LOG_RING_BYTES 1024
+#endif
+
+#if CONFIG_LOG_RING_BYTES & (CONFIG_LOG_RING_BYTES - 1)
+#error CONFIG_LOG_RING_BYTES must be a power of two
+#endif
+
+// Digit size: 8 (products fit in 16 bits) or 16 (products fit in 32 bits,
+// computed by the MPY32 peripheral on MSP430). Channels store one digit
+// per 16-bit word either way, so 16-bit digits halve the storage.
+#ifndef CONFIG_DIGIT_BITS
+#define CONFIG_DIGIT_BITS 8
+#endif
+
+#define DIGIT_BITS       CONFIG_DIGIT_BITS
+#define DIGIT_BYTES      (DIGIT_BITS / 8)
+#define MAX_DIGITS       (MODULUS_MAX_BITS / DIGIT_BITS)
+#define KEY_SIZE_MAX_BYTES (KEY_SIZE_BITS / 8)
+#define MODULUS_MAX_BYTES  (MODULUS_MAX_BITS / 8)
+
+#if CONFIG_KEY_SIZE_RUNTIME
+// Size of the key of the current message, set by task_init
+static __nv unsigned key_bytes;
+static __nv unsigned key_digits;
+
+#define KEY_SIZE_BYTES   key_bytes
+#define NUM_DIGITS       key_digits
+#else
+#define KEY_SIZE_BYTES   KEY_SIZE_MAX_BYTES
+#define NUM_DIGITS       MAX_DIGITS
+#endif
+
+#define NUM_DIGITS_x2    (NUM_DIGITS * 2)
+#define MODULUS_BYTES    (NUM_DIGITS * DIGIT_BYTES)
+#define MODULUS_BITS     (MODULUS_BYTES * 8)
+
+/** @brief Type that stores one digit */
+typedef uint16_t digit_t;
+
+#if DIGIT_BITS == 8
 #define DIGIT_MASK       0x00ff
-#define NUM_DIGITS       (KEY_SIZE_BITS / DIGIT_BITS)
-#define NUM_DIGITS_x2    32
 
 /** @brief Type large enough to store a product of two digits */
-typedef uint16_t digit_t;
+typedef uint16_t ddigit_t;
+#elif DIGIT_BITS == 16
+#define DIGIT_MASK       0xffff
+
+/** @brief Type large enough to store a product of two digits */
+typedef uint32_t ddigit_t;
+#else
+#error Unsupported digit size: CONFIG_DIGIT_BITS must be 8 or 16
+#endif
+
+#define DIGIT_BASE ((ddigit_t)1 << DIGIT_BITS)
+
+// Product of two digits: on MSP430, 16x16 goes to the hardware multiplier
+// through libmspmath; 8x8 (and any host build) is left to the compiler.
+#if DIGIT_BITS == 16 && defined(__MSP430__)
+#define MULT_DIGITS(a, b) mult16(a, b)
+#else
+#define MULT_DIGITS(a, b) ((ddigit_t)(a) * (b))
+#endif
 
 typedef struct {
-    uint8_t n[NUM_DIGITS]; // modulus
-    digit_t e;  // exponent
+    uint8_t n[KEY_SIZE_MAX_BYTES]; // modulus
+    uint8_t e[KEY_SIZE_MAX_BYTES]; // exponent, zero-extended to the width of N
 } pubkey_t;
 
-#if NUM_DIGITS < 2
+typedef struct {
+    uint8_t n[KEY_SIZE_MAX_BYTES]; // modulus
+    uint8_t e[KEY_SIZE_MAX_BYTES]; // public exponent
+    uint8_t p[MODULUS_MAX_BYTES]; // primes, p > q
+    uint8_t q[MODULUS_MAX_BYTES];
+    uint8_t dp[MODULUS_MAX_BYTES]; // d mod (p - 1)
+    uint8_t dq[MODULUS_MAX_BYTES]; // d mod (q - 1)
+    uint8_t qinv[MODULUS_MAX_BYTES]; // q^-1 mod p
+} privkey_t;
+
+#if MAX_DIGITS < 2
 #error The modular reduction implementation requires at least 2 digits
 #endif
 
+// Modular reduction performed by the mult-mod hypertask:
+//   REDUCE_SCHOOLBOOK: long division of the product, one quotient digit at a time
+//   REDUCE_MONTGOMERY: operands are kept in the Montgomery domain (x * R mod N,
+//                      R = b^NUM_DIGITS) and each product is reduced by REDC
+//   REDUCE_BARRETT:    quotient estimated from mu = floor(b^(2k) / N), which is
+//                      computed once per key, followed by a few subtractions
+#define REDUCE_SCHOOLBOOK 0
+#define REDUCE_MONTGOMERY 1
+#define REDUCE_BARRETT    2
+
+#ifndef CONFIG_REDUCE
+#define CONFIG_REDUCE REDUCE_MONTGOMERY
+#endif
+
+// For keys of at least CONFIG_KARATSUBA_MIN_BITS, the full product is computed
+// by recursive Karatsuba multiplication, down to operands of
+// CONFIG_KARATSUBA_LEAF_DIGITS digits, which are multiplied by schoolbook.
+#ifndef CONFIG_KARATSUBA_MIN_BITS
+#define CONFIG_KARATSUBA_MIN_BITS 1024
+#endif
+
+#ifndef CONFIG_KARATSUBA_LEAF_DIGITS
+#define CONFIG_KARATSUBA_LEAF_DIGITS 16
+#endif
+
+// The recursion is laid out for the digits of the modulus at compile time:
+// not with the key size at run time.
+#define KARATSUBA (MODULUS_MAX_BITS >= CONFIG_KARATSUBA_MIN_BITS && !CONFIG_KEY_SIZE_RUNTIME)
+
+// Recursion depth bound (levels, including the leaves): 2048-bit key in
+// 8-bit digits split down to one digit.
+#define KARATSUBA_MAX_LEVELS 9
+
+#if KARATSUBA
+#if MAX_DIGITS <= CONFIG_KARATSUBA_LEAF_DIGITS || MAX_DIGITS % CONFIG_KARATSUBA_LEAF_DIGITS || \
+    ((MAX_DIGITS / CONFIG_KARATSUBA_LEAF_DIGITS) & (MAX_DIGITS / CONFIG_KARATSUBA_LEAF_DIGITS - 1))
+#error Karatsuba requires NUM_DIGITS to be the leaf size times a power of two (at least 2)
+#endif
+#if MAX_DIGITS / CONFIG_KARATSUBA_LEAF_DIGITS >= (1 << KARATSUBA_MAX_LEVELS)
+#error Karatsuba recursion too deep: increase CONFIG_KARATSUBA_LEAF_DIGITS
+#endif
+#endif
+
+// Number of product columns that one instance of the multiplication task
+// computes (Comba): 1 (default) commits after every column, NUM_DIGITS_x2
+// computes the whole product in a single transition.
+#ifndef CONFIG_MULT_COLUMNS
+#define CONFIG_MULT_COLUMNS 1
+#endif
+
+#if CONFIG_MULT_COLUMNS < 1
+#error CONFIG_MULT_COLUMNS must be at least 1
+#endif
+
+// In the Montgomery mode, interleave the reduction with the multiplication
+// (one REDC step per digit of A, CIOS) instead of reducing the full product.
+// Not available with Karatsuba, which needs the full product.
+#ifndef CONFIG_MONT_CIOS
+#define CONFIG_MONT_CIOS (!KARATSUBA)
+#endif
+
+#if CONFIG_MONT_CIOS && KARATSUBA
+#error The fused Montgomery kernels (CONFIG_MONT_CIOS) cannot be combined with Karatsuba
+#endif
+
+// Exponentiation: left-to-right binary (0, default), or sliding window over a
+// table of odd powers of the base (1), which pays off for long (private)
+// exponents.
+#ifndef CONFIG_EXP_SLIDING_WINDOW
+#define CONFIG_EXP_SLIDING_WINDOW 0
+#endif
+
+#ifndef CONFIG_EXP_WINDOW_BITS
+#if KEY_SIZE_BITS > 512
+#define CONFIG_EXP_WINDOW_BITS 5
+#else
+#define CONFIG_EXP_WINDOW_BITS 4
+#endif
+#endif
+
+// Odd powers b, b^3, ..., b^(2^w - 1)
+#define EXP_TABLE_SIZE (1 << (CONFIG_EXP_WINDOW_BITS - 1))
+#define EXP_NO_MULT (-1)
+
+// Fixed public exponent of the form 2^k + 1, computed by a straight-line
+// chain of k squarings and one multiplication instead of the exponentiation
+// loop. Other exponents fall back to the loop. 0 disables.
+#ifndef CONFIG_EXP_CHAIN
+#define CONFIG_EXP_CHAIN 3
+#endif
+
+#if CONFIG_EXP_CHAIN == 0
+#elif CONFIG_EXP_CHAIN == 3
+#define EXP_CHAIN_SQUARES 1
+#elif CONFIG_EXP_CHAIN == 5
+#define EXP_CHAIN_SQUARES 2
+#elif CONFIG_EXP_CHAIN == 17
+#define EXP_CHAIN_SQUARES 4
+#elif CONFIG_EXP_CHAIN == 257
+#define EXP_CHAIN_SQUARES 8
+#elif CONFIG_EXP_CHAIN == 65537
+#define EXP_CHAIN_SQUARES 16
+#else
+#error CONFIG_EXP_CHAIN must be 0 or one of 3, 5, 17, 257, 65537
+#endif
+
 #define LED1 (1 << 0)
 #define LED2 (1 << 1)
 
@@ -51,109 +416,408 @@ typedef struct {
 
 #define PRINT_HEX_ASCII_COLS 8
 
+// Output frame: sync byte, type, sequence number (2 bytes, LSB first), payload
+// length (2 bytes, LSB first), payload, then the CRC-16/CCITT (initial value
+// 0xFFFF, 2 bytes, LSB first) of everything from the type to the payload
+#define FRAME_SYNC          0x7E
+#define FRAME_HEADER_BYTES  6
+#define FRAME_CRC_BYTES     2
+
+// Largest payload: the public key (exponent and N), the benchmark, or in the
+// hybrid mode a block of ChaCha20 cyphertext, which is longer than the key
+// below 480 bits
+#define FRAME_KEY_PAYLOAD   (2 * KEY_SIZE_MAX_BYTES)
+#define FRAME_BENCH_PAYLOAD 10
+#define FRAME_MAX2(a, b) ((a) > (b) ? (a) : (b))
+#define FRAME_MAX_PAYLOAD \
+    FRAME_MAX2(FRAME_MAX2(FRAME_KEY_PAYLOAD, FRAME_BENCH_PAYLOAD), \
+               CONFIG_HYBRID ? CHACHA_BLOCK_BYTES : 0)
+
+#if CONFIG_OUTPUT_RING_BYTES < FRAME_HEADER_BYTES + FRAME_MAX_PAYLOAD + FRAME_CRC_BYTES
+#error CONFIG_OUTPUT_RING_BYTES must hold the largest frame
+#endif
+
+// Frame types, and what their sequence number is
+#define FRAME_KEY   0x01 // public key (exponent, N, of the width of N); 0
+#define FRAME_BLOCK 0x02 // block of cyphertext; index of the block
+#define FRAME_END   0x03 // length of the cyphertext; number of blocks
+#define FRAME_BENCH 0x04 // cycles of the message (6 bytes), cycles waiting for the ring (4); 0
+
+// Frame types received, and what their sequence number is
+#define FRAME_KEY_PROVISION 0x10 // public key (exponent, N, of the width of N) for the store; 0
+
 // #define SHOW_PROGRESS_ON_LED
 // #define SHOW_COARSE_PROGRESS_ON_LED
 
-// Blocks are padded with these digits (on the MSD side). Padding value must be
+// Blocks are padded with these bytes (on the MSB side). Padding value must be
 // chosen such that block value is less than the modulus. This is accomplished
 // by any value below 0x80, because the modulus is restricted to be above
-// 0x80 (see comments below).
-static const uint8_t PAD_DIGITS[] = { 0x01 };
-#define NUM_PAD_DIGITS (sizeof(PAD_DIGITS) / sizeof(PAD_DIGITS[0]))
+// 0x80 (see comments below). Padding is byte-wise so that the block layout
+// does not depend on the digit size.
+static const uint8_t PAD_BYTES[] = { 0x01 };
+#define NUM_PAD_BYTES (sizeof(PAD_BYTES) / sizeof(PAD_BYTES[0]))
 
-// To generate a key pair: see scripts/
+// To generate a key pair: see scripts/; to import one: scripts/pem2key.py
 
 // modulus: byte order: LSB to MSB, constraint MSB>=0x80
 static __ro_nv const pubkey_t pubkey = {
 #include "../data/key32.txt"
 };
 
+#if !CONFIG_STREAM_INPUT
 static __ro_nv const unsigned char PLAINTEXT[] =
 #include "../data/plaintext.txt"
 ;
+#endif
+
+#define BLOCK_PAYLOAD_BYTES (KEY_SIZE_BYTES - NUM_PAD_BYTES)
+
+#if CONFIG_STREAM_INPUT
+// The block being filled may be overwritten only once the offset past it is
+// committed, i.e. when the next block is read
+#if CONFIG_STREAM_RING_BYTES < 2 * KEY_SIZE_MAX_BYTES
+#error CONFIG_STREAM_RING_BYTES must hold at least two blocks
+#endif
 
-#define NUM_PLAINTEXT_BLOCKS (sizeof(PLAINTEXT) / (NUM_DIGITS - NUM_PAD_DIGITS) + 1)
-#define CYPHERTEXT_SIZE (NUM_PLAINTEXT_BLOCKS * NUM_DIGITS)
+#define STREAM_EOT  0x04
+#define STREAM_XON  0x11
+#define STREAM_XOFF 0x13
+#define STREAM_XOFF_FREE 16 // free bytes left in the ring when the sender is paused
+#endif
+
+#if CONFIG_HYBRID
+#define SESSION_BYTES (CHACHA_KEY_BYTES + CHACHA_NONCE_BYTES) // what RSA encrypts
+
+// Samples of clock jitter per session, in chunks of the key and nonce of the
+// ChaCha20 block function, which conditions them (see session_draw)
+#define ENTROPY_CHUNK_BYTES (CHACHA_KEY_BYTES + CHACHA_NONCE_BYTES)
+#define ENTROPY_CHUNKS 8
+
+#define NUM_SESSION_KEY_BLOCKS \
+    ((SESSION_BYTES + BLOCK_PAYLOAD_BYTES - 1) / BLOCK_PAYLOAD_BYTES)
+#define WRAPPED_KEY_SIZE (NUM_SESSION_KEY_BLOCKS * KEY_SIZE_BYTES)
+#elif CONFIG_COMPRESS
+// Compressed format: the original length (2 bytes, LSB first), then tokens
+//   0lllllll            literal run: the next l + 1 bytes
+//   1mmmmddd dddddddd   match: m + 3 bytes, copied from d + 1 bytes back
+#define LZ_HEADER_BYTES 2
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + 15)
+#define LZ_MAX_LITERALS 128
+#define LZ_CHUNK 64 // input bytes per task
+
+// Worst case: all literals
+#define COMPRESSED_SIZE \
+    (LZ_HEADER_BYTES + sizeof(PLAINTEXT) + sizeof(PLAINTEXT) / LZ_MAX_LITERALS + 1)
+#endif
+
+#if CONFIG_DECRYPT
+// To import a key from data/private*.pem: see scripts/pem2key.py
+static __ro_nv const privkey_t privkey = {
+#include "../data/privkey128.txt"
+};
+
+// Cyphertext blocks, LSB first: see scripts/bin2c.py
+static __ro_nv const uint8_t CYPHERTEXT[] = {
+#include "../data/cyphertext.txt"
+};
+
+#define NUM_CYPHERTEXT_BLOCKS (sizeof(CYPHERTEXT) / KEY_SIZE_BYTES)
+#if CONFIG_KEY_SIZE_RUNTIME
+#define DECRYPTED_MAX_SIZE sizeof(CYPHERTEXT) // less the padding of each block
+#else
+#define DECRYPTED_MAX_SIZE (NUM_CYPHERTEXT_BLOCKS * BLOCK_PAYLOAD_BYTES)
+#endif
+
+// Prime selected as the modulus of the mult-mod hypertask
+#define CRT_NONE 0 // boot
+#define CRT_P    1
+#define CRT_Q    2
+#endif
 
 // If you link-in wisp-base, then you have to define some symbols.
 uint8_t usrBank[USRBANK_SIZE];
 
 struct msg_mult_mod_args {
-    CHAN_FIELD_ARRAY(digit_t, A, NUM_DIGITS);
-    CHAN_FIELD_ARRAY(digit_t, B, NUM_DIGITS);
+    CHAN_FIELD_ARRAY(digit_t, A, MAX_DIGITS);
+    CHAN_FIELD_ARRAY(digit_t, B, MAX_DIGITS);
+    CHAN_FIELD(task_t*, next_task);
+};
+
+struct msg_sqr_mod_args {
+    CHAN_FIELD_ARRAY(digit_t, A, MAX_DIGITS);
     CHAN_FIELD(task_t*, next_task);
 };
 
 struct msg_mult_mod_result {
-    CHAN_FIELD_ARRAY(digit_t, R, NUM_DIGITS);
+    CHAN_FIELD_ARRAY(digit_t, R, MAX_DIGITS);
 };
 
 struct msg_mult {
-    CHAN_FIELD_ARRAY(digit_t, A, NUM_DIGITS);
-    CHAN_FIELD_ARRAY(digit_t, B, NUM_DIGITS);
+    CHAN_FIELD_ARRAY(digit_t, A, MAX_DIGITS);
+    CHAN_FIELD_ARRAY(digit_t, B, MAX_DIGITS);
+    CHAN_FIELD(unsigned, digit);
+    CHAN_FIELD(ddigit_t, carry);
+    CHAN_FIELD(bool, square); // B is A (and is not sent)
+};
+
+struct msg_kara_args {
+    CHAN_FIELD_ARRAY(digit_t, X, MAX_DIGITS);
+    CHAN_FIELD_ARRAY(digit_t, Y, MAX_DIGITS);
+    CHAN_FIELD(unsigned, level);
+    CHAN_FIELD_ARRAY(unsigned, phase, KARATSUBA_MAX_LEVELS);
+};
+
+// Node frames of the Karatsuba recursion, one per level, laid out back to
+// back: level L has m = k / 2^L digit operands at offset 2k - 2m in X and Y.
+// Products of the children of level L are stored at the same offset in Z0
+// (low halves), Z2 (high halves) and Z1 (differences of the halves).
+struct msg_self_kara {
+    SELF_CHAN_FIELD_ARRAY(digit_t, X, MAX_DIGITS * 2);
+    SELF_CHAN_FIELD_ARRAY(digit_t, Y, MAX_DIGITS * 2);
+    SELF_CHAN_FIELD_ARRAY(digit_t, Z0, MAX_DIGITS * 2);
+    SELF_CHAN_FIELD_ARRAY(digit_t, Z1, MAX_DIGITS * 2);
+    SELF_CHAN_FIELD_ARRAY(digit_t, Z2, MAX_DIGITS * 2);
+    SELF_CHAN_FIELD(unsigned, level);
+    SELF_CHAN_FIELD_ARRAY(unsigned, phase, KARATSUBA_MAX_LEVELS);
+    SELF_CHAN_FIELD_ARRAY(bool, neg, KARATSUBA_MAX_LEVELS);
+};
+#define FIELD_INIT_msg_self_kara {\
+    SELF_FIELD_ARRAY_INITIALIZER(MAX_DIGITS * 2), \
+    SELF_FIELD_ARRAY_INITIALIZER(MAX_DIGITS * 2), \
+    SELF_FIELD_ARRAY_INITIALIZER(MAX_DIGITS * 2), \
+    SELF_FIELD_ARRAY_INITIALIZER(MAX_DIGITS * 2), \
+    SELF_FIELD_ARRAY_INITIALIZER(MAX_DIGITS * 2), \
+    SELF_FIELD_INITIALIZER, \
+    SELF_FIELD_ARRAY_INITIALIZER(KARATSUBA_MAX_LEVELS), \
+    SELF_FIELD_ARRAY_INITIALIZER(KARATSUBA_MAX_LEVELS) \
+}
+
+// Halves of the top-level Karatsuba product: the product is
+// Z0 + mid * b^(k/2) + Z2 * b^k, recombined column by column by task_mult
+struct msg_kara_product {
+    CHAN_FIELD_ARRAY(digit_t, Z0, MAX_DIGITS);
+    CHAN_FIELD_ARRAY(digit_t, Z2, MAX_DIGITS);
+    CHAN_FIELD_ARRAY(digit_t, mid, MAX_DIGITS + 1);
     CHAN_FIELD(unsigned, digit);
-    CHAN_FIELD(unsigned, carry);
+    CHAN_FIELD(ddigit_t, carry);
 };
 
 struct msg_reduce {
-    CHAN_FIELD_ARRAY(digit_t, N, NUM_DIGITS);
-    CHAN_FIELD_ARRAY(digit_t, M, NUM_DIGITS);
+    CHAN_FIELD_ARRAY(digit_t, N, MAX_DIGITS);
+    CHAN_FIELD_ARRAY(digit_t, M, MAX_DIGITS);
     CHAN_FIELD(task_t*, next_task);
 };
 
 struct msg_modulus {
-    CHAN_FIELD_ARRAY(digit_t, N, NUM_DIGITS);
+    CHAN_FIELD_ARRAY(digit_t, N, MAX_DIGITS);
+};
+
+#if CONFIG_REDUCE != REDUCE_SCHOOLBOOK || CONFIG_DECRYPT
+// Arguments of the division hypertask, X * b^shift mod N for X of len
+// digits, for the modulus that task_init set up. 'digit' is the next digit
+// of the dividend, from the top: 0 on a call.
+struct msg_mod_n_args {
+    CHAN_FIELD_ARRAY(digit_t, X, MAX_DIGITS * 2);
+    CHAN_FIELD(unsigned, len);
+    CHAN_FIELD(unsigned, shift);
+    CHAN_FIELD(unsigned, digit);
+    CHAN_FIELD(task_t*, next_task);
+};
+
+#if CONFIG_REDUCE == REDUCE_BARRETT
+// The remainder, and the low k+1 digits of the quotient (for mu)
+struct msg_mod_n_result {
+    CHAN_FIELD_ARRAY(digit_t, product, MAX_DIGITS);
+    CHAN_FIELD_ARRAY(digit_t, quotient, MAX_DIGITS + 1);
+};
+
+struct msg_self_mod_n {
+    SELF_CHAN_FIELD_ARRAY(digit_t, r, MAX_DIGITS);
+    SELF_CHAN_FIELD_ARRAY(digit_t, quotient, MAX_DIGITS + 1);
+    SELF_CHAN_FIELD(unsigned, digit);
+};
+#define FIELD_INIT_msg_self_mod_n {\
+    SELF_FIELD_ARRAY_INITIALIZER(MAX_DIGITS), \
+    SELF_FIELD_ARRAY_INITIALIZER(MAX_DIGITS + 1), \
+    SELF_FIELD_INITIALIZER \
+}
+#else
+struct msg_mod_n_result {
+    CHAN_FIELD_ARRAY(digit_t, product, MAX_DIGITS);
+};
+
+struct msg_self_mod_n {
+    SELF_CHAN_FIELD_ARRAY(digit_t, r, MAX_DIGITS);
+    SELF_CHAN_FIELD(unsigned, digit);
+};
+#define FIELD_INIT_msg_self_mod_n {\
+    SELF_FIELD_ARRAY_INITIALIZER(MAX_DIGITS), \
+    SELF_FIELD_INITIALIZER \
+}
+#endif
+#endif
+
+#if CONFIG_REDUCE != REDUCE_SCHOOLBOOK
+// Index of the key record being set up
+struct msg_key_record {
+    CHAN_FIELD(unsigned, record);
+};
+#endif
+
+// Arguments of the modular exponentiation hypertask, base^E mod N, for the
+// modulus that the mult-mod hypertask is set up with (see task_init). The
+// exponent is as wide as the modulus; base and result are not in the
+// Montgomery domain.
+struct msg_mod_exp_args {
+    CHAN_FIELD_ARRAY(digit_t, base, MAX_DIGITS);
+    CHAN_FIELD_ARRAY(digit_t, E, MAX_DIGITS);
+    CHAN_FIELD(task_t*, next_task);
 };
 
-struct msg_exponent {
-    CHAN_FIELD(digit_t, E);
+// Base of the exponentiation (in the Montgomery domain, if so configured),
+// which is also the initial accumulator
+struct msg_exp_base {
+    CHAN_FIELD_ARRAY(digit_t, base, MAX_DIGITS);
+    CHAN_FIELD_ARRAY(digit_t, product, MAX_DIGITS);
 };
 
-struct msg_self_exponent {
-    SELF_CHAN_FIELD(digit_t, E);
+#if CONFIG_REDUCE == REDUCE_MONTGOMERY
+struct msg_mont_domain {
+    CHAN_FIELD_ARRAY(digit_t, R2_mod_N, MAX_DIGITS); // for entering the domain
 };
-#define FIELD_INIT_msg_self_exponent {\
+#endif
+
+// Cursor of the binary exponentiation: the next exponent bit is bit 'bit' of
+// digit 'word' of E, and 'multiply' is set while the multiplication by the
+// base for that bit is pending.
+struct msg_exp_cursor {
+    CHAN_FIELD(int, word);
+    CHAN_FIELD(int, bit);
+    CHAN_FIELD(bool, multiply);
+};
+
+struct msg_self_exp_cursor {
+    SELF_CHAN_FIELD(int, word);
+    SELF_CHAN_FIELD(int, bit);
+    SELF_CHAN_FIELD(bool, multiply);
+};
+#define FIELD_INIT_msg_self_exp_cursor {\
+    SELF_FIELD_INITIALIZER, \
+    SELF_FIELD_INITIALIZER, \
+    SELF_FIELD_INITIALIZER \
+}
+
+struct msg_exp_table_args {
+    CHAN_FIELD_ARRAY(digit_t, base, MAX_DIGITS);
+    CHAN_FIELD(unsigned, size);
+    CHAN_FIELD(unsigned, index);
+};
+
+struct msg_self_exp_table {
+    SELF_CHAN_FIELD_ARRAY(digit_t, base_sq, MAX_DIGITS);
+    SELF_CHAN_FIELD(unsigned, index);
+};
+#define FIELD_INIT_msg_self_exp_table {\
+    SELF_FIELD_ARRAY_INITIALIZER(MAX_DIGITS), \
+    SELF_FIELD_INITIALIZER \
+}
+
+struct msg_exp_table {
+    CHAN_FIELD_ARRAY(digit_t, T, EXP_TABLE_SIZE * MAX_DIGITS);
+};
+
+// State of the window scan: next exponent bit, squarings and table entry
+// left to apply for the current window, and whether the accumulator is
+// still 1 (in which case the first window loads it from the table).
+struct msg_exp_window {
+    CHAN_FIELD(int, bit);
+    CHAN_FIELD(unsigned, squares);
+    CHAN_FIELD(int, index);
+    CHAN_FIELD(bool, one);
+};
+
+struct msg_self_exp_window {
+    SELF_CHAN_FIELD_ARRAY(digit_t, product, MAX_DIGITS); // accumulator
+    SELF_CHAN_FIELD(int, bit);
+    SELF_CHAN_FIELD(unsigned, squares);
+    SELF_CHAN_FIELD(int, index);
+    SELF_CHAN_FIELD(bool, one);
+};
+#define FIELD_INIT_msg_self_exp_window {\
+    SELF_FIELD_ARRAY_INITIALIZER(MAX_DIGITS), \
+    SELF_FIELD_INITIALIZER, \
+    SELF_FIELD_INITIALIZER, \
+    SELF_FIELD_INITIALIZER, \
     SELF_FIELD_INITIALIZER \
 }
 
+struct msg_exp_chain {
+    CHAN_FIELD(unsigned, step);
+};
+
+struct msg_self_exp_chain {
+    SELF_CHAN_FIELD(unsigned, step);
+};
+#define FIELD_INIT_msg_self_exp_chain {\
+    SELF_FIELD_INITIALIZER \
+}
+
+#if CONFIG_DECRYPT
+struct msg_crt_prime {
+    CHAN_FIELD(unsigned, prime);
+};
+
+struct msg_crt_block {
+    CHAN_FIELD(unsigned, block_offset);
+};
+
+struct msg_crt_mq {
+    CHAN_FIELD_ARRAY(digit_t, mq, MAX_DIGITS);
+};
+
+struct msg_self_crt_mq {
+    SELF_CHAN_FIELD_ARRAY(digit_t, mq, MAX_DIGITS);
+};
+#define FIELD_INIT_msg_self_crt_mq {\
+    SELF_FIELD_ARRAY_INITIALIZER(MAX_DIGITS) \
+}
+
+struct msg_decrypted {
+    CHAN_FIELD_ARRAY(uint8_t, decrypted, DECRYPTED_MAX_SIZE);
+    CHAN_FIELD(unsigned, decrypted_len);
+};
+#endif
+
 struct msg_mult_digit {
     CHAN_FIELD(unsigned, digit);
-    CHAN_FIELD(unsigned, carry);
+    CHAN_FIELD(ddigit_t, carry);
 };
 
 struct msg_self_mult_digit {
     SELF_CHAN_FIELD(unsigned, digit);
-    SELF_CHAN_FIELD(unsigned, carry);
+    SELF_CHAN_FIELD(ddigit_t, carry);
+    SELF_CHAN_FIELD(unsigned, len);
 };
 #define FIELD_INIT_msg_self_mult_digit {\
+    SELF_FIELD_INITIALIZER, \
     SELF_FIELD_INITIALIZER, \
     SELF_FIELD_INITIALIZER \
 }
 
+// The digits at and above 'len' are zero and are not written
 struct msg_product {
-    CHAN_FIELD_ARRAY(digit_t, product, NUM_DIGITS * 2);
+    CHAN_FIELD_ARRAY(digit_t, product, MAX_DIGITS * 2);
+    CHAN_FIELD(unsigned, len);
 };
 
 struct msg_self_product {
-    SELF_CHAN_FIELD_ARRAY(digit_t, product, NUM_DIGITS * 2);
+    SELF_CHAN_FIELD_ARRAY(digit_t, product, MAX_DIGITS * 2);
 };
 #define FIELD_INIT_msg_self_product {\
-    SELF_FIELD_ARRAY_INITIALIZER(NUM_DIGITS_x2)\
+    SELF_FIELD_ARRAY_INITIALIZER(MAX_DIGITS * 2)\
 }
 
-struct msg_base {
-    CHAN_FIELD_ARRAY(digit_t, base, NUM_DIGITS_x2);
-};
-
-struct msg_block {
-    CHAN_FIELD_ARRAY(digit_t, block, NUM_DIGITS_x2);
-};
-
-struct msg_base_block {
-    CHAN_FIELD_ARRAY(digit_t, base, NUM_DIGITS_x2);
-    CHAN_FIELD_ARRAY(digit_t, block, NUM_DIGITS_x2);
-};
-
 struct msg_cyphertext_len {
     CHAN_FIELD(unsigned, cyphertext_len);
 };
@@ -165,14 +829,45 @@ struct msg_self_cyphertext_len {
     SELF_FIELD_INITIALIZER \
 }
 
-struct msg_cyphertext {
-    CHAN_FIELD_ARRAY(digit_t, cyphertext, CYPHERTEXT_SIZE);
-    CHAN_FIELD(unsigned, cyphertext_len);
+#if CONFIG_COMPRESS && !CONFIG_DECRYPT
+// State of the compressor: next input byte, next output byte, and the open
+// literal run (position of its token byte, number of literals so far)
+struct msg_compress {
+    CHAN_FIELD(unsigned, message_length);
+    CHAN_FIELD(unsigned, in);
+    CHAN_FIELD(unsigned, out);
+    CHAN_FIELD(unsigned, run);
+    CHAN_FIELD(unsigned, literals);
+};
+
+struct msg_self_compress {
+    SELF_CHAN_FIELD(unsigned, in);
+    SELF_CHAN_FIELD(unsigned, out);
+    SELF_CHAN_FIELD(unsigned, run);
+    SELF_CHAN_FIELD(unsigned, literals);
+};
+#define FIELD_INIT_msg_self_compress {\
+    SELF_FIELD_INITIALIZER, \
+    SELF_FIELD_INITIALIZER, \
+    SELF_FIELD_INITIALIZER, \
+    SELF_FIELD_INITIALIZER \
+}
+
+struct msg_compressed {
+    CHAN_FIELD_ARRAY(uint8_t, compressed, COMPRESSED_SIZE);
+    CHAN_FIELD(unsigned, message_length);
+};
+#endif
+
+#if CONFIG_HYBRID
+struct msg_session_key {
+    CHAN_FIELD_ARRAY(uint8_t, session, SESSION_BYTES); // key, then nonce
 };
+#endif
 
 struct msg_divisor {
-    CHAN_FIELD(unsigned, digit);
-    CHAN_FIELD(digit_t, n_div);
+    CHAN_FIELD(ddigit_t, n_div);
+    CHAN_FIELD(digit_t, n_recip);
 };
 
 struct msg_digit {
@@ -204,89 +899,250 @@ struct msg_self_block_offset {
 struct msg_message_info {
     CHAN_FIELD(unsigned, message_length);
     CHAN_FIELD(unsigned, block_offset);
-    CHAN_FIELD(digit_t, E);
 };
 
 struct msg_quotient {
+    CHAN_FIELD(unsigned, digit);
     CHAN_FIELD(digit_t, quotient);
 };
 
 struct msg_print {
-    CHAN_FIELD_ARRAY(digit_t, product, NUM_DIGITS_x2);
+    CHAN_FIELD_ARRAY(digit_t, product, MAX_DIGITS * 2);
+    CHAN_FIELD(unsigned, len);
     CHAN_FIELD(task_t*, next_task);
 };
 
+struct msg_n_prime {
+    CHAN_FIELD(digit_t, n_prime);
+};
+
+struct msg_self_mont_reduce {
+    SELF_CHAN_FIELD_ARRAY(digit_t, product, MAX_DIGITS * 2);
+    SELF_CHAN_FIELD(unsigned, digit);
+    SELF_CHAN_FIELD(ddigit_t, carry);
+};
+#define FIELD_INIT_msg_self_mont_reduce {\
+    SELF_FIELD_ARRAY_INITIALIZER(MAX_DIGITS * 2), \
+    SELF_FIELD_INITIALIZER, \
+    SELF_FIELD_INITIALIZER \
+}
+
+struct msg_self_mont_mult {
+    SELF_CHAN_FIELD_ARRAY(digit_t, acc, MAX_DIGITS + 1);
+    SELF_CHAN_FIELD(unsigned, digit);
+};
+#define FIELD_INIT_msg_self_mont_mult {\
+    SELF_FIELD_ARRAY_INITIALIZER(MAX_DIGITS + 1), \
+    SELF_FIELD_INITIALIZER \
+}
+
+struct msg_barrett_mu {
+    CHAN_FIELD_ARRAY(digit_t, mu, MAX_DIGITS + 1);
+};
+
+struct msg_barrett_quotient {
+    CHAN_FIELD_ARRAY(digit_t, quotient, MAX_DIGITS + 1);
+    CHAN_FIELD(unsigned, digit);
+    CHAN_FIELD(ddigit_t, carry);
+    CHAN_FIELD(unsigned, borrow);
+};
+
+struct msg_self_barrett_multiply {
+    SELF_CHAN_FIELD(unsigned, digit);
+    SELF_CHAN_FIELD(ddigit_t, carry);
+    SELF_CHAN_FIELD(unsigned, borrow);
+};
+#define FIELD_INIT_msg_self_barrett_multiply {\
+    SELF_FIELD_INITIALIZER, \
+    SELF_FIELD_INITIALIZER, \
+    SELF_FIELD_INITIALIZER \
+}
+
 TASK(1,  task_init)
 TASK(2,  task_pad)
 TASK(3,  task_exp)
-TASK(4,  task_mult_block)
-TASK(5,  task_mult_block_get_result)
-TASK(6,  task_square_base)
-TASK(7,  task_square_base_get_result)
 TASK(8,  task_print_cyphertext)
 TASK(9,  task_mult_mod)
 TASK(10,  task_mult)
 TASK(11, task_reduce_digits)
 TASK(12, task_reduce_normalizable)
 TASK(13, task_reduce_normalize)
-TASK(14, task_reduce_n_divisor)
 TASK(15, task_reduce_quotient)
-TASK(16, task_reduce_multiply)
-TASK(17, task_reduce_compare)
-TASK(18, task_reduce_add)
 TASK(19, task_reduce_subtract)
 TASK(20, task_print_product)
-
-MULTICAST_CHANNEL(msg_base, ch_base, task_init, task_square_base, task_mult_block);
-CHANNEL(task_init, task_pad, msg_message_info);
-CHANNEL(task_init, task_mult_block_get_result, msg_cyphertext_len);
-CHANNEL(task_pad, task_exp, msg_exponent);
-CHANNEL(task_pad, task_mult_block, msg_block);
-SELF_CHANNEL(task_pad, msg_self_block_offset);
-MULTICAST_CHANNEL(msg_base, ch_base, task_pad, task_mult_block, task_square_base);
-SELF_CHANNEL(task_exp, msg_self_exponent);
-CHANNEL(task_exp, task_mult_block_get_result, msg_exponent);
-CHANNEL(task_mult_block_get_result, task_mult_block, msg_block);
-SELF_CHANNEL(task_mult_block_get_result, msg_self_cyphertext_len);
-CHANNEL(task_mult_block_get_result, task_print_cyphertext, msg_cyphertext);
-MULTICAST_CHANNEL(msg_base, ch_square_base, task_square_base_get_result,
-                  task_square_base, task_mult_block);
+TASK(24, task_sqr_mod)
+#if KARATSUBA
+TASK(26, task_kara)
+#endif
+#if CONFIG_EXP_CHAIN
+TASK(29, task_exp_chain)
+#endif
+#if CONFIG_DECRYPT
+TASK(30, task_crt_block)
+TASK(31, task_crt_reduce)
+TASK(32, task_crt_base)
+TASK(33, task_crt_result)
+TASK(44, task_crt_qinv)
+TASK(34, task_crt_garner)
+TASK(35, task_print_decrypted)
+#endif
+TASK(36, task_mod_exp)
+TASK(37, task_mod_exp_base)
+TASK(38, task_mod_exp_done)
+TASK(39, task_save_block)
+#if CONFIG_HYBRID
+TASK(40, task_chacha)
+#endif
+#if CONFIG_COMPRESS && !CONFIG_DECRYPT
+TASK(41, task_compress)
+#endif
+#if CONFIG_REDUCE != REDUCE_SCHOOLBOOK || CONFIG_DECRYPT
+TASK(42, task_mod_n)
+#endif
+#if CONFIG_REDUCE != REDUCE_SCHOOLBOOK
+TASK(43, task_key_done)
+#endif
+#if CONFIG_EXP_SLIDING_WINDOW
+TASK(27, task_exp_table)
+TASK(28, task_exp_window)
+#endif
+#if CONFIG_REDUCE == REDUCE_MONTGOMERY
+TASK(21, task_mont_reduce)
+#if CONFIG_MONT_CIOS
+TASK(22, task_mont_mult)
+TASK(25, task_mont_sqr)
+#endif
+#elif CONFIG_REDUCE == REDUCE_BARRETT
+TASK(21, task_barrett_quotient)
+TASK(22, task_barrett_multiply)
+TASK(23, task_barrett_correct)
+#endif
+
+CHANNEL(task_init, task_pad, msg_message_info);
+CHANNEL(task_init, task_save_block, msg_cyphertext_len);
+SELF_CHANNEL(task_pad, msg_self_block_offset);
+SELF_CHANNEL(task_save_block, msg_self_cyphertext_len);
+CHANNEL(task_save_block, task_print_cyphertext, msg_cyphertext_len);
+#if CONFIG_COMPRESS && !CONFIG_DECRYPT
+CHANNEL(task_init, task_compress, msg_compress);
+SELF_CHANNEL(task_compress, msg_self_compress);
+CHANNEL(task_compress, task_pad, msg_compressed);
+#endif
+#if CONFIG_HYBRID
+MULTICAST_CHANNEL(msg_session_key, ch_session_key, task_init, task_pad, task_chacha);
+CHANNEL(task_init, task_chacha, msg_message_info);
+SELF_CHANNEL(task_chacha, msg_self_block_offset);
+CHANNEL(task_chacha, task_print_cyphertext, msg_cyphertext_len);
+#endif
+#if CONFIG_DECRYPT
+CHANNEL(task_init, task_crt_block, msg_crt_block);
+CHANNEL(task_crt_garner, task_crt_block, msg_crt_block);
+MULTICAST_CHANNEL(msg_crt_block, ch_crt_block, task_crt_block,
+                  task_crt_reduce, task_crt_garner);
+CHANNEL(task_crt_block, task_init, msg_crt_prime);
+CHANNEL(task_crt_result, task_init, msg_crt_prime);
+MULTICAST_CHANNEL(msg_crt_prime, ch_crt_prime, task_init,
+                  task_crt_base, task_crt_result);
+SELF_CHANNEL(task_crt_result, msg_self_crt_mq);
+CHANNEL(task_crt_result, task_crt_garner, msg_crt_mq);
+CHANNEL(task_crt_garner, task_print_decrypted, msg_decrypted);
+CHANNEL(task_crt_block, task_print_decrypted, msg_decrypted);
+#endif
+CALL_CHANNEL(ch_mod_exp, msg_mod_exp_args);
+RET_CHANNEL(ch_mod_exp, msg_product);
+#if CONFIG_REDUCE == REDUCE_MONTGOMERY
+CHANNEL(task_init, task_mod_exp, msg_mont_domain);
+#endif
+MULTICAST_CHANNEL(msg_exp_base, ch_exp_base, task_mod_exp_base,
+                  task_exp, task_exp_chain, task_mod_exp_done);
+#if CONFIG_EXP_CHAIN
+CHANNEL(task_mod_exp_base, task_exp_chain, msg_exp_chain);
+SELF_CHANNEL(task_exp_chain, msg_self_exp_chain);
+#endif
+#if CONFIG_EXP_SLIDING_WINDOW
+CHANNEL(task_exp, task_exp_table, msg_exp_table_args);
+SELF_CHANNEL(task_exp_table, msg_self_exp_table);
+CHANNEL(task_exp_table, task_exp_window, msg_exp_table);
+CHANNEL(task_exp, task_exp_window, msg_exp_window);
+SELF_CHANNEL(task_exp_window, msg_self_exp_window);
+CHANNEL(task_exp_window, task_mod_exp_done, msg_product);
+#else
+CHANNEL(task_mod_exp_base, task_exp, msg_exp_cursor);
+SELF_CHANNEL(task_exp, msg_self_exp_cursor);
+#endif
 CALL_CHANNEL(ch_mult_mod, msg_mult_mod_args);
 RET_CHANNEL(ch_mult_mod, msg_product);
 CHANNEL(task_mult_mod, task_mult, msg_mult);
+CALL_CHANNEL(ch_sqr_mod, msg_sqr_mod_args);
+CHANNEL(task_sqr_mod, task_mult, msg_mult);
+#if KARATSUBA
+CHANNEL(task_mult_mod, task_kara, msg_kara_args);
+CHANNEL(task_sqr_mod, task_kara, msg_kara_args);
+SELF_CHANNEL(task_kara, msg_self_kara);
+CHANNEL(task_kara, task_mult, msg_kara_product);
+#endif
 MULTICAST_CHANNEL(msg_modulus, ch_modulus, task_init,
                   task_reduce_normalizable, task_reduce_normalize,
-                  task_reduce_n_divisor, task_reduce_quotient, task_reduce_multiply);
+                  task_reduce_quotient, task_reduce_subtract);
+#if CONFIG_REDUCE != REDUCE_SCHOOLBOOK || CONFIG_DECRYPT
+CALL_CHANNEL(ch_mod_n, msg_mod_n_args);
+RET_CHANNEL(ch_mod_n, msg_mod_n_result);
+SELF_CHANNEL(task_mod_n, msg_self_mod_n);
+#endif
+#if CONFIG_REDUCE != REDUCE_SCHOOLBOOK
+CHANNEL(task_init, task_key_done, msg_key_record);
+#endif
 SELF_CHANNEL(task_mult, msg_self_mult_digit);
 MULTICAST_CHANNEL(msg_product, ch_mult_product, task_mult,
                   task_reduce_normalizable, task_reduce_normalize,
-                  task_reduce_quotient, task_reduce_compare,
-                  task_reduce_add, task_reduce_subtract);
+                  task_reduce_quotient, task_reduce_subtract);
 MULTICAST_CHANNEL(msg_digit, ch_digit, task_reduce_digits,
                   task_reduce_normalizable, task_reduce_quotient);
 CHANNEL(task_reduce_normalizable, task_reduce_normalize, msg_offset);
 // TODO: rename 'product' to 'block' or something
 MULTICAST_CHANNEL(msg_product, ch_product, task_mult,
-                  task_reduce_digits, task_reduce_n_divisor,
+                  task_reduce_digits,
                   task_reduce_normalizable, task_reduce_normalize,
-                  task_reduce_quotient, task_reduce_compare,
-                  task_reduce_add, task_reduce_subtract);
+                  task_reduce_quotient, task_reduce_subtract);
 MULTICAST_CHANNEL(msg_product, ch_normalized_product, task_reduce_normalize,
-                  task_reduce_quotient, task_reduce_compare,
-                  task_reduce_add, task_reduce_subtract);
-CHANNEL(task_reduce_add, task_reduce_subtract, msg_product);
+                  task_reduce_quotient, task_reduce_subtract);
 MULTICAST_CHANNEL(msg_product, ch_reduce_subtract_product, task_reduce_subtract,
-                  task_reduce_quotient, task_reduce_compare, task_reduce_add);
+                  task_reduce_quotient);
 SELF_CHANNEL(task_reduce_subtract, msg_self_product);
-CHANNEL(task_reduce_n_divisor, task_reduce_quotient, msg_divisor);
+CHANNEL(task_init, task_reduce_quotient, msg_divisor);
 SELF_CHANNEL(task_reduce_quotient, msg_self_digit);
-MULTICAST_CHANNEL(msg_digit, ch_reduce_digit, task_reduce_quotient,
-                  task_reduce_multiply, task_reduce_compare,
-                  task_reduce_add, task_reduce_subtract);
-CHANNEL(task_reduce_quotient, task_reduce_multiply, msg_quotient);
-MULTICAST_CHANNEL(msg_product, ch_qn, task_reduce_multiply,
-                  task_reduce_compare, task_reduce_subtract);
+CHANNEL(task_reduce_quotient, task_reduce_subtract, msg_quotient);
 CALL_CHANNEL(ch_print_product, msg_print);
+#if CONFIG_REDUCE == REDUCE_MONTGOMERY
+MULTICAST_CHANNEL(msg_n_prime, ch_n_prime, task_init,
+                  task_mont_reduce, task_mont_mult, task_mont_sqr,
+                  task_mod_exp_done);
+CHANNEL(task_mult, task_mont_reduce, msg_mult_digit);
+SELF_CHANNEL(task_mont_reduce, msg_self_mont_reduce);
+#if CONFIG_MONT_CIOS
+CHANNEL(task_mult_mod, task_mont_mult, msg_digit);
+SELF_CHANNEL(task_mont_mult, msg_self_mont_mult);
+CHANNEL(task_sqr_mod, task_mont_sqr, msg_digit);
+SELF_CHANNEL(task_mont_sqr, msg_self_mont_mult);
+#endif
+#elif CONFIG_REDUCE == REDUCE_BARRETT
+CHANNEL(task_init, task_barrett_quotient, msg_barrett_mu);
+CHANNEL(task_mult, task_barrett_quotient, msg_mult_digit);
+SELF_CHANNEL(task_barrett_quotient, msg_self_mult_digit);
+CHANNEL(task_barrett_quotient, task_barrett_multiply, msg_barrett_quotient);
+SELF_CHANNEL(task_barrett_multiply, msg_self_barrett_multiply);
+CHANNEL(task_barrett_multiply, task_barrett_correct, msg_product);
+#endif
+
+#if !CONFIG_OUTPUT_HEX
+static void out_ring_resume();
+#endif
+#if CONFIG_BENCH && !CONFIG_OUTPUT_HEX && defined(__MSP430__)
+static uint32_t bench_now();
+#endif
+#if CONFIG_KEY_STORE && !defined(__MSP430__)
+static void key_rx_file(const char *path);
+#endif
 
 void init()
 {
@@ -304,9 +1160,22 @@ void init()
         GPIO(PORT_LED_3, DIR) |= BIT(PIN_LED_3);
 #endif
 #endif
+
+#if CONFIG_STREAM_INPUT && defined(__MSP430__)
+    UCA0IE |= UCRXIE; // receiver of the message
+#elif CONFIG_KEY_STORE && defined(__MSP430__)
+    UCA0IE |= UCRXIE; // receiver of keys to provision
+#endif
         
     __enable_interrupt();
 
+#if !CONFIG_OUTPUT_HEX
+    out_ring_resume();
+#endif
+#if CONFIG_KEY_STORE && !defined(__MSP430__)
+    key_rx_file(CONFIG_KEY_FILE);
+#endif
+
 #if defined(PORT_LED_3) // when available, this LED indicates power-on
     GPIO(PORT_LED_3, OUT) |= BIT(PIN_LED_3);
     GPIO(PORT_LED_1, OUT) &= ~BIT(PIN_LED_1); 
@@ -342,6 +1211,7 @@ static void blink(unsigned count, uint32_t duration, unsigned leds)
 }
 #endif
 
+#if CONFIG_OUTPUT_HEX || CONFIG_DECRYPT // the binary frames carry the key instead
 static void print_hex_ascii(const uint8_t *m, unsigned len)
 {
     int i, j;
@@ -361,401 +1231,2851 @@ static void print_hex_ascii(const uint8_t *m, unsigned len)
         printf("\r\n");
     }
 }
+#endif
 
-void task_init()
+// Output of the cyphertext, one block as soon as the block is done, in a
+// frame or on a line prefixed by the index of the block. The index of the
+// next block to output is committed to FRAM right after the block, so that a
+// task re-executed after a power failure neither outputs its block again nor
+// skips it. Only a failure in the middle of a block repeats it, under the same
+// index: the receiver keeps the last complete copy of each index.
+static __nv unsigned out_next_block;
+
+#if !CONFIG_OUTPUT_HEX || CONFIG_KEY_STORE
+// Checksum of the frames, and of the key slots
+static uint16_t crc16_ccitt(const uint8_t *p, unsigned len)
 {
     int i;
-    unsigned message_length = sizeof(PLAINTEXT) - 1; // skip the terminating null byte
+    uint16_t crc = 0xFFFF;
 
-    LOG("init\r\n");
+    while (len--) {
+        crc ^= (uint16_t)*p++ << 8;
+        for (i = 0; i < 8; ++i)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+#endif
 
-#ifdef SHOW_COARSE_PROGRESS_ON_LED
-    blink(1, BLINK_DURATION_BOOT, LED1 | LED2);
+#if !CONFIG_OUTPUT_HEX
+// Frame being built, sent in one write once complete
+static uint8_t out_frame[FRAME_HEADER_BYTES + FRAME_MAX_PAYLOAD + FRAME_CRC_BYTES];
+static unsigned out_frame_len;
+
+// Transmit ring. Whole frames are appended at 'head' and committed by moving
+// it; 'sent' is the start of the first frame not yet completely out of the
+// UART. Both are running byte counts, in FRAM with the bytes: frames queued
+// before a power failure are sent after it, and a frame cut by the failure is
+// sent again from its start (for the receiver to drop the partial copy).
+static __nv struct {
+    uint8_t buf[CONFIG_OUTPUT_RING_BYTES];
+    volatile unsigned head;
+    volatile unsigned sent;
+} out_ring;
+
+#define OUT_RING_BYTE(i) out_ring.buf[(i) & (CONFIG_OUTPUT_RING_BYTES - 1)]
+
+#if defined(__MSP430__)
+// Frame being transmitted: next byte and end (running counts, so either may
+// wrap to 0), and whether there is one at all
+static volatile unsigned out_tx_next, out_tx_end;
+static volatile bool out_tx_busy;
+
+// Starts the transmission of the next frame in the ring, if any (with
+// interrupts disabled, or from the interrupt)
+static void out_tx_start()
+{
+    unsigned len;
+
+    out_tx_next = out_ring.sent;
+    if (out_tx_next == out_ring.head) {
+        out_tx_busy = false;
+        return;
+    }
+    out_tx_busy = true;
+    len = OUT_RING_BYTE(out_tx_next + 4) | (OUT_RING_BYTE(out_tx_next + 5) << 8);
+    out_tx_end = out_tx_next + FRAME_HEADER_BYTES + len + FRAME_CRC_BYTES;
+    UCA0IE |= UCTXIE;
+}
+
+// Transmitter, from the UART interrupt. A frame is committed as sent only
+// once its last bit is out (UCTXCPTIFG), not when its last byte enters the
+// UART.
+static void out_tx_ready()
+{
+    if (out_tx_next != out_tx_end) {
+        UCA0TXBUF = OUT_RING_BYTE(out_tx_next);
+        out_tx_next++;
+    } else {
+        UCA0IE &= ~UCTXIE;
+        UCA0IFG &= ~UCTXCPTIFG;
+        UCA0IE |= UCTXCPTIE;
+    }
+}
+
+static void out_tx_complete()
+{
+    UCA0IE &= ~UCTXCPTIE;
+    out_ring.sent = out_tx_end;
+    out_tx_start();
+}
+#endif // __MSP430__
+
+// Queues a whole frame, or nothing when the ring has no room for it.
+// Does not wait for the UART.
+static bool out_ring_put(const uint8_t *buf, unsigned len)
+{
+    unsigned i, head = out_ring.head;
+
+    if (CONFIG_OUTPUT_RING_BYTES - (head - out_ring.sent) < len)
+        return false;
+    for (i = 0; i < len; ++i)
+        OUT_RING_BYTE(head + i) = buf[i];
+    out_ring.head = head + len; // commit
+
+#if defined(__MSP430__)
+    __disable_interrupt();
+    if (!out_tx_busy)
+        out_tx_start();
+    __enable_interrupt();
+#else // host build: the sink is stdout, which is always ready
+    for (i = out_ring.sent; i != out_ring.head; ++i)
+        putchar(OUT_RING_BYTE(i));
+    out_ring.sent = out_ring.head;
 #endif
+    return true;
+}
 
-    printf("Message:\r\n"); print_hex_ascii(PLAINTEXT, message_length);
-    printf("Public key: exp = 0x%x  N = \r\n", pubkey.e);
-    print_hex_ascii(pubkey.n, NUM_DIGITS);
+// Resumes the transmission of the frames queued before a power failure
+static void out_ring_resume()
+{
+#if defined(__MSP430__)
+    __disable_interrupt();
+    out_tx_start();
+    __enable_interrupt();
+#endif
+}
 
-    LOG("init: out modulus\r\n");
+#if CONFIG_BENCH
+static uint32_t bench_out_wait; // cycles waiting for room in the ring (none on a host build)
+#endif
 
-    // TODO: consider passing pubkey as a structure type
-    for (i = 0; i < NUM_DIGITS; ++i) {
-        CHAN_OUT1(digit_t, N[i], pubkey.n[i], MC_OUT_CH(ch_modulus, task_init,
-                 task_reduce_normalizable, task_reduce_normalize,
-                 task_reduce_m_divisor, task_reduce_quotient,
-                 task_reduce_multiply, task_reduce_add));
+// Frames are never dropped, since the block in one is already committed as
+// output: when the ring is full, the task waits (in LPM0) for room.
+static void out_write(const uint8_t *buf, unsigned len)
+{
+#if defined(__MSP430__)
+#if CONFIG_BENCH
+    uint32_t start = bench_now();
+#endif
+
+    __disable_interrupt();
+    while (CONFIG_OUTPUT_RING_BYTES - (out_ring.head - out_ring.sent) < len) {
+        __bis_SR_register(LPM0_bits | GIE); // until a frame is out
+        __disable_interrupt();
     }
+    __enable_interrupt();
+#if CONFIG_BENCH
+    bench_out_wait += bench_now() - start;
+#endif
+#endif
+    out_ring_put(buf, len);
+}
 
-    LOG("init: out exp\r\n");
+#if !CONFIG_LOG_DEFERRED && CONFIG_LOG_LEVEL > LOG_LEVEL_NONE
+// Waits (in LPM0) until the frames in the ring are all out of the UART,
+// before the immediate log prints
+static void out_flush()
+{
+#if defined(__MSP430__)
+    __disable_interrupt();
+    while (out_tx_busy) {
+        __bis_SR_register(LPM0_bits | GIE); // until a frame is out
+        __disable_interrupt();
+    }
+    __enable_interrupt();
+#endif
+}
+#endif
 
-    unsigned zero = 0;
-    CHAN_OUT1(digit_t, E, pubkey.e, CH(task_init, task_pad));
-    CHAN_OUT1(unsigned, message_length, message_length, CH(task_init, task_pad));
-    CHAN_OUT1(unsigned, block_offset, zero, CH(task_init, task_pad));
-    CHAN_OUT1(unsigned, cyphertext_len, zero, CH(task_init, task_mult_block_get_result));
+static void out_frame_begin(uint8_t type, unsigned seq)
+{
+    out_frame[0] = FRAME_SYNC;
+    out_frame[1] = type;
+    out_frame[2] = seq & 0xff;
+    out_frame[3] = seq >> 8;
+    out_frame_len = FRAME_HEADER_BYTES;
+}
 
-    LOG("init: done\r\n");
+static void out_byte(uint8_t c)
+{
+    if (out_frame_len == FRAME_HEADER_BYTES + FRAME_MAX_PAYLOAD) {
+        printf("ERROR: frame payload over %u bytes\r\n", FRAME_MAX_PAYLOAD);
+        while(1);
+    }
+    out_frame[out_frame_len++] = c;
+}
 
-    TRANSITION_TO(task_pad);
+static void out_frame_end()
+{
+    unsigned payload = out_frame_len - FRAME_HEADER_BYTES;
+    uint16_t crc;
+
+    out_frame[4] = payload & 0xff;
+    out_frame[5] = payload >> 8;
+    crc = crc16_ccitt(&out_frame[1], out_frame_len - 1);
+    out_frame[out_frame_len++] = crc & 0xff;
+    out_frame[out_frame_len++] = crc >> 8;
+    out_write(out_frame, out_frame_len);
+}
+#else // CONFIG_OUTPUT_HEX
+static void out_byte(uint8_t c)
+{
+    printf("%02x ", c);
 }
+#endif // CONFIG_OUTPUT_HEX
 
-void task_pad()
+static bool out_block_begin(unsigned index)
 {
-    int i;
-    unsigned block_offset, message_length;
-    digit_t m, e;
+    if (index < out_next_block)
+        return false; // output before the power failure
+#if CONFIG_OUTPUT_HEX
+    printf("%u: ", index);
+#else
+    out_frame_begin(FRAME_BLOCK, index);
+#endif
+    return true;
+}
 
-#ifdef SHOW_COARSE_PROGRESS_ON_LED
-    GPIO(PORT_LED_1, OUT) &= ~BIT(PIN_LED_1);
+static void out_block_end(unsigned index)
+{
+#if CONFIG_OUTPUT_HEX
+    printf("\r\n");
+#else
+    out_frame_end();
 #endif
+    out_next_block = index + 1;
+}
 
-    block_offset = *CHAN_IN2(unsigned, block_offset, CH(task_init, task_pad),
-                                           SELF_IN_CH(task_pad));
+#if CONFIG_LOG_DEFERRED && CONFIG_LOG_LEVEL > LOG_LEVEL_NONE
+// Deferred log. The format string of a site goes to the log_fmt section,
+// which is never read on the device; the offset of the string in the section
+// is the ID of the site. A record is:
+//   ID (2 bytes), task sequence number (curctx->time, 2 bytes), number of
+//   arguments (the top bit set on the first record of a task execution),
+//   mask of the 4-byte arguments, arguments (2 or 4 bytes each)
+// all LSB first. The ring keeps the latest records: 'head' and 'first' (the
+// oldest record kept) are running byte counts, and a record is committed by
+// moving 'head' past it, so a power failure never leaves a partial record.
+// A task cut by a power failure runs again with the same sequence number,
+// and logs again: dlog.py keeps the records of its last execution only.
+// The ring is the log_ring symbol; dlog.py tells how to dump it.
+#define LOG_RECORD_HEADER_BYTES 6
+#define LOG_MAX_ARGS 8
+#define LOG_RECORD_FIRST 0x80
+
+static __nv struct {
+    uint8_t buf[CONFIG_LOG_RING_BYTES];
+    uint16_t head;
+    uint16_t first;
+} log_ring;
+
+#define LOG_RING_BYTE(i) log_ring.buf[(uint16_t)(i) & (CONFIG_LOG_RING_BYTES - 1)]
+
+extern const char __start_log_fmt[];
+
+static uint16_t log_pos; // end of the record being written
+
+// Sequence number of the task of the last record, in RAM: lost at a power
+// failure, so the first record after it starts an execution
+static uint16_t log_time;
+static bool log_time_valid;
+
+static unsigned log_record_bytes(unsigned nargs, uint8_t wide)
+{
+    unsigned len = LOG_RECORD_HEADER_BYTES + 2 * nargs;
 
-    message_length = *CHAN_IN1(unsigned, message_length, CH(task_init, task_pad));
+    for (; wide; wide >>= 1)
+        len += 2 * (wide & 1);
+    return len;
+}
 
-    LOG("pad: len=%u offset=%u\r\n", message_length, block_offset);
+static void log_begin(uint16_t id, unsigned nargs, uint8_t wide)
+{
+    unsigned len = log_record_bytes(nargs, wide);
+    uint16_t time = curctx->time;
+
+    while ((uint16_t)(log_ring.head + len - log_ring.first) > CONFIG_LOG_RING_BYTES)
+        log_ring.first += log_record_bytes(LOG_RING_BYTE(log_ring.first + 4) & ~LOG_RECORD_FIRST,
+                                           LOG_RING_BYTE(log_ring.first + 5));
+
+    if (!log_time_valid || time != log_time)
+        nargs |= LOG_RECORD_FIRST;
+    log_time = time;
+    log_time_valid = true;
+
+    log_pos = log_ring.head;
+    LOG_RING_BYTE(log_pos++) = id & 0xff;
+    LOG_RING_BYTE(log_pos++) = id >> 8;
+    LOG_RING_BYTE(log_pos++) = time & 0xff;
+    LOG_RING_BYTE(log_pos++) = time >> 8;
+    LOG_RING_BYTE(log_pos++) = nargs;
+    LOG_RING_BYTE(log_pos++) = wide;
+}
 
-    if (block_offset >= message_length) {
-        LOG("pad: message done\r\n");
-        TRANSITION_TO(task_print_cyphertext);
+static void log_arg(uint32_t x, bool wide)
+{
+    LOG_RING_BYTE(log_pos++) = x;
+    LOG_RING_BYTE(log_pos++) = x >> 8;
+    if (wide) {
+        LOG_RING_BYTE(log_pos++) = x >> 16;
+        LOG_RING_BYTE(log_pos++) = x >> 24;
     }
+}
 
-    /*
-    LOG("process block: padded block at offset=%u: ", block_offset);
-    for (i = 0; i < NUM_PAD_DIGITS; ++i)
-        LOG("%x ", PAD_DIGITS[i]);
-    LOG("'");
-    for (i = NUM_DIGITS - NUM_PAD_DIGITS - 1; i >= 0; --i)
-        LOG("%x ", PLAINTEXT[block_offset + i]);
-    LOG("\r\n");
-    */
-    for (i = 0; i < NUM_DIGITS - NUM_PAD_DIGITS; ++i) {
-        m = (block_offset + i < message_length) ? PLAINTEXT[block_offset + i] : 0xFF;
-        LOG("For iteration %u m = %u \r\n",i,m); 
-        CHAN_OUT1(digit_t, base[i], m, MC_OUT_CH(ch_base, task_pad, task_mult_block, task_square_base));
-    }
-    LOG("next loop: \r\n"); 
-    for (i = NUM_DIGITS - NUM_PAD_DIGITS; i < NUM_DIGITS; ++i) {
-        LOG("For iteration %u m = %u \r\n",i,PAD_DIGITS[i]); 
-        CHAN_OUT1(digit_t, base[i], PAD_DIGITS[i],
-                 MC_OUT_CH(ch_base, task_pad, task_mult_block, task_square_base));
-    }
+static void log_end()
+{
+    log_ring.head = log_pos; // commit
+}
 
-    digit_t one = 1;
-    digit_t zero = 0;
-    CHAN_OUT1(digit_t, block[0], one, CH(task_pad, task_mult_block));
-    for (i = 1; i < NUM_DIGITS; ++i)
-        CHAN_OUT1(digit_t, block[i], zero, CH(task_pad, task_mult_block));
+// Applies m(index, argument) to each of up to LOG_MAX_ARGS arguments
+#define LOG_NARGS(...) LOG_NARGS_(_, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(_, a1, a2, a3, a4, a5, a6, a7, a8, n, ...) n
+#define LOG_EACH(m, ...) LOG_EACH_(LOG_NARGS(__VA_ARGS__), m, ##__VA_ARGS__)
+#define LOG_EACH_(n, m, ...) LOG_EACH__(n, m, ##__VA_ARGS__)
+#define LOG_EACH__(n, m, ...) LOG_EACH_##n(m, 0, ##__VA_ARGS__)
+#define LOG_EACH_0(m, i)
+#define LOG_EACH_1(m, i, a)      m(i, a)
+#define LOG_EACH_2(m, i, a, ...) m(i, a) LOG_EACH_1(m, i + 1, __VA_ARGS__)
+#define LOG_EACH_3(m, i, a, ...) m(i, a) LOG_EACH_2(m, i + 1, __VA_ARGS__)
+#define LOG_EACH_4(m, i, a, ...) m(i, a) LOG_EACH_3(m, i + 1, __VA_ARGS__)
+#define LOG_EACH_5(m, i, a, ...) m(i, a) LOG_EACH_4(m, i + 1, __VA_ARGS__)
+#define LOG_EACH_6(m, i, a, ...) m(i, a) LOG_EACH_5(m, i + 1, __VA_ARGS__)
+#define LOG_EACH_7(m, i, a, ...) m(i, a) LOG_EACH_6(m, i + 1, __VA_ARGS__)
+#define LOG_EACH_8(m, i, a, ...) m(i, a) LOG_EACH_7(m, i + 1, __VA_ARGS__)
+
+#define LOG_WIDE(x) (sizeof(x) > 2)
+#define LOG_WIDE_MASK(i, x) | (LOG_WIDE(x) << (i))
+#define LOG_ARG(i, x) log_arg((uint32_t)(x), LOG_WIDE(x));
+
+#define LOG_DEFERRED(fmt, ...) do { \
+    static const char log_fmt[] __attribute__((section("log_fmt"))) = fmt; \
+    log_begin(log_fmt - __start_log_fmt, LOG_NARGS(__VA_ARGS__), \
+              0 LOG_EACH(LOG_WIDE_MASK, ##__VA_ARGS__)); \
+    LOG_EACH(LOG_ARG, ##__VA_ARGS__) \
+    log_end(); \
+} while (0)
+#define LOG_SITE LOG_DEFERRED
+#elif !CONFIG_OUTPUT_HEX
+#define LOG_SITE(...) do { out_flush(); LOG(__VA_ARGS__); } while (0)
+#else
+#define LOG_SITE LOG
+#endif // CONFIG_LOG_DEFERRED
+
+#if CONFIG_LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_SITE(__VA_ARGS__)
+#else
+#define LOG_INFO(...) do { } while (0)
+#endif
+#if CONFIG_LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_SITE(__VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do { } while (0)
+#endif
+#if CONFIG_LOG_LEVEL >= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) LOG_SITE(__VA_ARGS__)
+#else
+#define LOG_TRACE(...) do { } while (0)
+#endif
 
-    e = *CHAN_IN1(digit_t, E, CH(task_init, task_pad));
-    CHAN_OUT1(digit_t, E, e, CH(task_pad, task_exp));
+#if CONFIG_REDUCE != REDUCE_SCHOOLBOOK || CONFIG_DECRYPT
+// Final correction step of Montgomery and Barrett reduction: subtract N from
+// t (k+1 digits) if t >= N. Returns whether a subtraction was made. The
+// caller passes k, which is NUM_DIGITS as it read it for its own loops.
+static bool sub_n_if_ge(digit_t *t, const digit_t *n, unsigned k)
+{
+    int i;
+    ddigit_t m, s;
+    unsigned borrow;
 
-    block_offset += NUM_DIGITS - NUM_PAD_DIGITS;
-    CHAN_OUT1(unsigned, block_offset, block_offset, SELF_OUT_CH(task_pad));
+    for (i = k - 1; i > 0 && t[i] == n[i]; --i);
+    if (!t[k] && t[i] < n[i])
+        return false;
 
-#ifdef SHOW_COARSE_PROGRESS_ON_LED
-    GPIO(PORT_LED_1, OUT) |= BIT(PIN_LED_1);
-#endif
-    TRANSITION_TO(task_exp);
+    borrow = 0;
+    for (i = 0; i < k; ++i) {
+        m = t[i];
+        s = n[i] + borrow;
+        if (m < s) {
+            m += DIGIT_BASE;
+            borrow = 1;
+        } else {
+            borrow = 0;
+        }
+        t[i] = m - s;
+    }
+    t[k] -= borrow;
+    return true;
 }
 
-void task_exp()
+// One step of bit-serial long division by N: r = 2r + bit mod N, for r < N
+// (r has room for k+1 digits).
+// Returns whether N was subtracted, i.e. the next bit of the quotient.
+static bool double_mod_n(digit_t *r, const digit_t *n, unsigned bit)
 {
-    digit_t e;
-    bool multiply;
-
-    e = *CHAN_IN2(digit_t, E, CH(task_pad, task_exp), SELF_IN_CH(task_exp));
-    LOG("exp: e=%x\r\n", e);
+    int i;
+    ddigit_t s, c;
 
-    // ASSERT: e > 0
+    c = bit;
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        s = ((ddigit_t)r[i] << 1) + c;
+        r[i] = s & DIGIT_MASK;
+        c = s >> DIGIT_BITS;
+    }
+    r[NUM_DIGITS] = c;
 
-    multiply = e & 0x1;
+    return sub_n_if_ge(r, n, NUM_DIGITS);
+}
+#endif
 
-    e >>= 1;
-    CHAN_OUT1(digit_t, E, e, SELF_OUT_CH(task_exp));
-    CHAN_OUT1(digit_t, E, e, CH(task_exp, task_mult_block_get_result));
+#if CONFIG_DECRYPT
+// Digits from bytes, LSB first
+static void unpack_digits(digit_t *x, const uint8_t *bytes, unsigned len)
+{
+    int i, j;
 
-    if (multiply) {
-        TRANSITION_TO(task_mult_block);
-    } else {
-        TRANSITION_TO(task_square_base);
+    for (i = 0; i < len; ++i) {
+        x[i] = 0;
+        for (j = DIGIT_BYTES - 1; j >= 0; --j)
+            x[i] = (x[i] << 8) | bytes[i * DIGIT_BYTES + j];
     }
 }
+#endif
 
-// TODO: is this task strictly necessary? it only makes a call. Can this call
-// be rolled into task_exp?
-void task_mult_block()
+#if CONFIG_REDUCE == REDUCE_MONTGOMERY
+// One REDC step on t (k+2 digits): t = (t + u * N) / b, with u = t[0] * n'
+// mod b chosen so that the division is exact. The top digit t[k+1] is folded
+// into t[k] and left as is. k is passed as for sub_n_if_ge.
+static void mont_redc_step(digit_t *t, const digit_t *n, digit_t n_prime,
+                           unsigned k)
 {
-    int i;
-    digit_t b, m;
+    int j;
+    digit_t u;
+    ddigit_t s, c;
 
-    LOG("mult block\r\n");
-    
-    LOG("WRITING FROM %x and %x \r\n",MC_IN_CH(ch_base,task_pad,task_mult_block), 
-                MC_IN_CH(ch_square_base, task_square_base_get_result, task_mult_block));
+    u = MULT_DIGITS(t[0], n_prime) & DIGIT_MASK;
+    c = 0;
+    for (j = 0; j < k; ++j) {
+        s = t[j] + MULT_DIGITS(u, n[j]) + c;
+        c = s >> DIGIT_BITS;
+        if (j > 0) // digit 0 is zero by choice of u
+            t[j - 1] = s & DIGIT_MASK;
+    }
+    s = t[k] + c;
+    t[k - 1] = s & DIGIT_MASK;
+    t[k] = t[k + 1] + (s >> DIGIT_BITS);
+}
+#endif
 
-    // TODO: pass args to mult: message * base
-    for (i = 0; i < NUM_DIGITS; ++i) {
-        m = *CHAN_IN2(digit_t, block[i], CH(task_pad, task_mult_block),
-                                CH(task_mult_block_get_result, task_mult_block));
-        
-        b = *CHAN_IN2(digit_t, base[i], MC_IN_CH(ch_base, task_pad, task_mult_block),
-                               MC_IN_CH(ch_square_base, task_square_base_get_result, task_mult_block));
-        LOG("mult block: a[%u]=%x b[%u]=%x\r\n", i, b, i, m);
-        
-        CHAN_OUT1(digit_t, A[i], b, CALL_CH(ch_mult_mod));
+#if CONFIG_HYBRID
+// Pool of the session generator, in FRAM: each session absorbs fresh samples
+// into it and draws its key and nonce from it
+static __nv uint8_t session_pool[CHACHA_KEY_BYTES];
+
+#if defined(__MSP430__)
+// One sample of clock jitter: the count of CPU loop iterations (MCLK, from
+// the DCO) until the next tick of Timer A1 (ACLK, from the VLO or a crystal).
+// The two clocks are independent, and the low bits of the count vary from
+// tick to tick with their jitter.
+static uint8_t entropy_sample()
+{
+    uint8_t count = 0;
+    uint16_t tick = TA1R;
 
-        CHAN_OUT1(digit_t, B[i], m, CALL_CH(ch_mult_mod));
+    while (TA1R == tick)
+        ++count;
+    return count;
+}
+#else
+static uint8_t entropy_sample()
+{
+    static FILE *urandom;
 
+    if (!urandom && !(urandom = fopen("/dev/urandom", "rb"))) {
+        printf("ERROR: no entropy source\r\n");
+        while(1);
     }
-    const task_t *next_task = TASK_REF(task_mult_block_get_result);  
-    CHAN_OUT1(task_t*, next_task, next_task , CALL_CH(ch_mult_mod));
-    TRANSITION_TO(task_mult_mod);
+    return fgetc(urandom);
 }
+#endif
 
-void task_mult_block_get_result()
+// Draws the key and nonce of a new session (SESSION_BYTES) into out. The
+// ChaCha20 block function conditions the samples, as the compression function
+// of a hash: each chunk goes in as its key (XORed with the pool) and nonce,
+// and the first 32 bytes of the output are the next pool. The session and the
+// pool left for the next one then come from two blocks under the final pool,
+// so that the pool in FRAM does not give the session away.
+static void session_draw(uint8_t *out)
 {
-    int i;
-    digit_t m, e;
-    unsigned cyphertext_len;
+    int i, j;
+    uint8_t chunk[ENTROPY_CHUNK_BYTES], block[CHACHA_BLOCK_BYTES];
+    static const uint8_t nonce[CHACHA_NONCE_BYTES] = { 0 };
 
-    LOG("mult block get result: block: ");
-    for (i = NUM_DIGITS - 1; i >= 0; --i) { // reverse for printing
-        m = *CHAN_IN1(digit_t, product[i], RET_CH(ch_mult_mod));
-        LOG("%x ", m);
-        CHAN_OUT1(digit_t, block[i], m, CH(task_mult_block_get_result, task_mult_block));
+#if defined(__MSP430__)
+    TA1CTL = TASSEL__ACLK | MC__CONTINUOUS | TACLR;
+#endif
+    memcpy(block, session_pool, CHACHA_KEY_BYTES);
+    for (i = 0; i < ENTROPY_CHUNKS; ++i) {
+        for (j = 0; j < ENTROPY_CHUNK_BYTES; ++j)
+            chunk[j] = entropy_sample();
+        for (j = 0; j < CHACHA_KEY_BYTES; ++j)
+            chunk[j] ^= block[j];
+        chacha_block(block, chunk, i, &chunk[CHACHA_KEY_BYTES]);
     }
-    LOG("\r\n");
+#if defined(__MSP430__)
+    TA1CTL = MC__STOP;
+#endif
 
-    e = *CHAN_IN1(digit_t, E, CH(task_exp, task_mult_block_get_result));
+    memcpy(chunk, block, CHACHA_KEY_BYTES);
+    chacha_block(block, chunk, ENTROPY_CHUNKS, nonce);
+    memcpy(out, block, SESSION_BYTES);
+    chacha_block(block, chunk, ENTROPY_CHUNKS + 1, nonce);
+    memcpy(session_pool, block, CHACHA_KEY_BYTES);
+}
+#endif // CONFIG_HYBRID
+
+#if CONFIG_STREAM_INPUT
+// Receive ring, in FRAM so that received bytes survive a power failure. The
+// receiver appends at 'head', a running count of the bytes received, and
+// may reuse the bytes before 'tail', the committed read offset of task_pad.
+// Offsets wrap around with unsigned arithmetic (the ring size divides it).
+static __nv struct {
+    uint8_t buf[CONFIG_STREAM_RING_BYTES];
+    volatile unsigned head;
+    volatile unsigned tail;
+    volatile bool end; // EOT received
+    volatile bool paused; // XOFF sent
+} stream_in;
+
+#define STREAM_IN_BYTE(i) stream_in.buf[(i) & (CONFIG_STREAM_RING_BYTES - 1)]
+
+// Blocks of the longest message, whose cyphertext length fits in 16 bits
+#define STREAM_MAX_BLOCKS (UINT16_MAX / KEY_SIZE_BYTES)
+
+#if defined(__MSP430__)
+static void stream_in_send(uint8_t c)
+{
+    while (!(UCA0IFG & UCTXIFG));
+    UCA0TXBUF = c;
+}
 
-    // On last iteration we don't need to square base
-    if (e > 0) {
+// Receiver, from the UART interrupt
+static void stream_in_rx(uint8_t c)
+{
+    unsigned used;
 
-        // TODO: current implementation restricts us to send only to the next instantiation
-        // of self, so for now, as a workaround, we proxy the value in every instantiation
-        cyphertext_len = *CHAN_IN2(unsigned, cyphertext_len,
-                                   CH(task_init, task_mult_block_get_result),
-                                   SELF_IN_CH(task_mult_block_get_result));
-        CHAN_OUT1(unsigned, cyphertext_len, cyphertext_len, SELF_OUT_CH(task_mult_block_get_result));
+    if (stream_in.end)
+        return;
 
-        TRANSITION_TO(task_square_base);
+    if (c == STREAM_EOT) {
+        stream_in.end = true;
+    } else {
+        used = stream_in.head - stream_in.tail;
+        if (used < CONFIG_STREAM_RING_BYTES) { // else lost: the sender ignored XOFF
+            STREAM_IN_BYTE(stream_in.head) = c;
+            stream_in.head++;
+            used++;
+        }
+        if (!stream_in.paused && CONFIG_STREAM_RING_BYTES - used <= STREAM_XOFF_FREE) {
+            stream_in_send(STREAM_XOFF);
+            stream_in.paused = true;
+        }
+    }
+}
+#endif // __MSP430__
 
-    } else { // block is finished, save it
+static void stream_in_reset()
+{
+    __disable_interrupt();
+    stream_in.head = stream_in.tail = 0;
+    stream_in.end = false;
+    stream_in.paused = false;
+    __enable_interrupt();
+}
 
-        cyphertext_len = *CHAN_IN2(unsigned, cyphertext_len,
-                                   CH(task_init, task_mult_block_get_result),
-                                   SELF_IN_CH(task_mult_block_get_result));
-        LOG("mult block get result: cyphertext len=%u\r\n", cyphertext_len);
+// Releases the bytes before the given (committed) offset to the receiver and
+// waits until 'count' bytes from there are in the ring or the stream has
+// ended. Returns the number of bytes available, up to 'count'.
+static unsigned stream_in_wait(unsigned offset, unsigned count)
+{
+    unsigned avail;
 
-        if (cyphertext_len + NUM_DIGITS <= CYPHERTEXT_SIZE) {
+    stream_in.tail = offset;
 
-            for (i = 0; i < NUM_DIGITS; ++i) { // reverse for printing
-                // TODO: we could save this read by rolling this loop into the
-                // above loop, by paying with an extra conditional in the
-                // above-loop.
-                m = *CHAN_IN1(digit_t, product[i], RET_CH(ch_mult_mod));
-                CHAN_OUT1(digit_t, cyphertext[cyphertext_len], m,
-                         CH(task_mult_block_get_result, task_print_cyphertext));
-                cyphertext_len++;
-            }
+#if defined(__MSP430__)
+    __disable_interrupt();
+    if (stream_in.paused &&
+        CONFIG_STREAM_RING_BYTES - (stream_in.head - offset) >= CONFIG_STREAM_RING_BYTES / 2) {
+        stream_in_send(STREAM_XON);
+        stream_in.paused = false;
+    }
+    while (stream_in.head - offset < count && !stream_in.end) {
+        __bis_SR_register(LPM0_bits | GIE); // until the next byte
+        __disable_interrupt();
+    }
+    __enable_interrupt();
+#else // host build: read stdin, as far as needed
+    int c;
 
+    while (stream_in.head - offset < count && !stream_in.end) {
+        c = getchar();
+        if (c == EOF || c == STREAM_EOT) {
+            stream_in.end = true;
         } else {
-            printf("WARN: block dropped: cyphertext overlow [%u > %u]\r\n",
-                   cyphertext_len + NUM_DIGITS, CYPHERTEXT_SIZE);
-            // carry on encoding, though
+            STREAM_IN_BYTE(stream_in.head) = c;
+            stream_in.head++;
         }
+    }
+#endif
 
-        // TODO: implementation limitation: cannot multicast and send to self
-        // in the same macro
-        CHAN_OUT1(unsigned, cyphertext_len, cyphertext_len, SELF_OUT_CH(task_mult_block_get_result));
-        CHAN_OUT1(unsigned, cyphertext_len, cyphertext_len,
-                 CH(task_mult_block_get_result, task_print_cyphertext));
+    avail = stream_in.head - offset;
+    if ((int)avail < 0) // the last block, which was not full, is past
+        return 0;
+    return avail < count ? avail : count;
+}
+#endif // CONFIG_STREAM_INPUT
 
-        LOG("mult block get results: block done, cyphertext_len=%u\r\n", cyphertext_len);
-        TRANSITION_TO(task_pad);
-    }
+// The exponentiation takes E > 0 (the scan for its top bit stops at bit 0),
+// so an exponent (LSB first) that is zero over the width of the modulus is
+// rejected before the key is set up
+static bool exp_is_zero(const uint8_t *e, unsigned bytes)
+{
+    while (bytes--)
+        if (e[bytes])
+            return false;
+    return true;
+}
 
+#if CONFIG_KEY_STORE || CONFIG_KEY_SIZE_RUNTIME
+// Size in bytes of a modulus, stored LSB first in KEY_SIZE_MAX_BYTES
+static unsigned key_size_of(const uint8_t *n)
+{
+    unsigned bytes = KEY_SIZE_MAX_BYTES;
+
+    while (bytes > 0 && !n[bytes - 1])
+        --bytes;
+    return bytes;
 }
 
-// TODO: is this task necessary? it seems to act as nothing but a proxy
-// TODO: is there opportunity for special zero-copy optimization here
-void task_square_base()
+// Whether the build takes a key of this size
+static bool key_size_supported(unsigned bytes)
 {
-    int i;
-    digit_t b;
+#if CONFIG_KEY_SIZE_RUNTIME
+    const unsigned unit = DIGIT_BYTES * (CONFIG_DECRYPT ? 2 : 1); // one digit of the modulus
 
-    LOG("square base\r\n");
+    return bytes <= KEY_SIZE_MAX_BYTES && bytes % unit == 0 && bytes / unit >= 2;
+#else
+    return bytes == KEY_SIZE_MAX_BYTES;
+#endif
+}
+#endif
 
-    for (i = 0; i < NUM_DIGITS; ++i) {
-        b = *CHAN_IN2(digit_t, base[i], MC_IN_CH(ch_base, task_pad, task_square_base),
-                               MC_IN_CH(ch_square_base, task_square_base_get_result, task_square_base));
-        CHAN_OUT1(digit_t, A[i], b, CALL_CH(ch_mult_mod));
-        CHAN_OUT1(digit_t, B[i], b, CALL_CH(ch_mult_mod));
+#if CONFIG_KEY_SIZE_RUNTIME
+// Sizes the digit loops of the message for the key with modulus n
+static void key_size_set(const uint8_t *n)
+{
+    unsigned bytes = key_size_of(n);
 
-        LOG("square base: b[%u]=%x\r\n", i, b);
+    if (!key_size_supported(bytes)) {
+        printf("ERROR: unsupported key size: %u bits\r\n", bytes * 8);
+        while(1);
     }
-    const task_t *next_task =TASK_REF(task_square_base_get_result);  
-    CHAN_OUT1(task_t *, next_task, next_task , CALL_CH(ch_mult_mod));
-    TRANSITION_TO(task_mult_mod);
+    key_bytes = bytes;
+    key_digits = (CONFIG_DECRYPT ? bytes / 2 : bytes) / DIGIT_BYTES;
+    LOG_INFO("init: key size %u bits, %u digits\r\n", bytes * 8, key_digits);
 }
+#endif
+
+#if CONFIG_KEY_STORE
+// Key slots. A slot is valid when its checksum matches; the newest valid one
+// (by serial number) holds the current key. A new key goes to a slot other
+// than the newest, which is invalidated first and gets its checksum last, so
+// a power failure while a key is stored leaves the previous key current.
+struct key_slot {
+    uint16_t serial;
+    pubkey_t key;
+    uint16_t crc; // of everything above
+};
 
-// TODO: is there opportunity for special zero-copy optimization here
-void task_square_base_get_result()
+static __nv struct key_slot key_slots[CONFIG_KEY_SLOTS];
+
+// Key of the message being encrypted, copied from the store by task_init, so
+// that keys stored in the meantime do not affect it
+static __nv pubkey_t key_current;
+#define PUBKEY key_current
+
+#define KEY_SLOT_CRC(slot) crc16_ccitt((const uint8_t *)(slot), offsetof(struct key_slot, crc))
+
+static struct key_slot *key_store_newest()
 {
     int i;
-    digit_t b;
-
-    LOG("square base get result\r\n");
+    struct key_slot *slot, *newest = NULL;
+
+    for (i = 0; i < CONFIG_KEY_SLOTS; ++i) {
+        slot = &key_slots[i];
+        if (slot->crc != KEY_SLOT_CRC(slot))
+            continue;
+        if (!newest || (int16_t)(slot->serial - newest->serial) > 0)
+            newest = slot;
+    }
+    return newest;
+}
 
-    for (i = 0; i < NUM_DIGITS; ++i) {
-        b = *CHAN_IN1(digit_t,product[i], RET_CH(ch_mult_mod));
-        LOG("suqare base get result: base[%u]=%x\r\n", i, b);
-        CHAN_OUT1(digit_t, base[i], b, MC_OUT_CH(ch_square_base, task_square_base_get_result,
-                                     task_square_base, task_mult_block));
+// Stores a key with an exponent and modulus of the given bytes as the newest,
+// unless it is not a usable key (odd modulus, of a size the build takes, with
+// its top byte set, as for the compiled-in keys, and a non-zero exponent) or
+// it is the newest already
+static bool key_store_put(const uint8_t *e, const uint8_t *n, unsigned bytes)
+{
+    int i;
+    struct key_slot *newest = key_store_newest(), *slot = NULL;
+
+    if (!key_size_supported(bytes) || !(n[0] & 1) || n[bytes - 1] < 0x80)
+        return false;
+    if (exp_is_zero(e, bytes))
+        return false;
+
+    if (newest && key_size_of(newest->key.n) == bytes &&
+        !memcmp(newest->key.e, e, bytes) && !memcmp(newest->key.n, n, bytes))
+        return true;
+
+    // An invalid slot, or else the oldest
+    for (i = 0; i < CONFIG_KEY_SLOTS; ++i) {
+        if (&key_slots[i] == newest)
+            continue;
+        if (key_slots[i].crc != KEY_SLOT_CRC(&key_slots[i])) {
+            slot = &key_slots[i];
+            break;
+        }
+        if (!slot || (int16_t)(key_slots[i].serial - slot->serial) < 0)
+            slot = &key_slots[i];
     }
 
-    TRANSITION_TO(task_exp);
+    slot->crc = ~KEY_SLOT_CRC(slot);
+    slot->serial = newest ? newest->serial + 1 : 1;
+    memcpy(slot->key.e, e, bytes);
+    memset(slot->key.e + bytes, 0, KEY_SIZE_MAX_BYTES - bytes);
+    memcpy(slot->key.n, n, bytes);
+    memset(slot->key.n + bytes, 0, KEY_SIZE_MAX_BYTES - bytes);
+    slot->crc = KEY_SLOT_CRC(slot);
+    return true;
 }
 
-void task_print_cyphertext()
+// Receiver of the provisioning frames, byte by byte (in the output frame
+// format, with a payload of the exponent and N, both of the width of N, LSB
+// first). It runs in the
+// UART interrupt, so it only checks a frame; the key goes to the store from
+// task_init (key_rx_store), and until then the receiver drops further frames.
+#define KEY_FRAME_MAX_PAYLOAD (2 * KEY_SIZE_MAX_BYTES)
+
+static uint8_t key_rx_frame[FRAME_HEADER_BYTES + KEY_FRAME_MAX_PAYLOAD + FRAME_CRC_BYTES];
+static unsigned key_rx_len;
+static volatile bool key_rx_ready; // key_rx_frame holds a checked frame
+
+static void key_rx(uint8_t c)
 {
-    int i, j = 0;
-    unsigned cyphertext_len;
-    digit_t c;
-    char line[PRINT_HEX_ASCII_COLS];
+    uint8_t *f = key_rx_frame;
+    unsigned payload, end;
+
+    if (key_rx_ready || (!key_rx_len && c != FRAME_SYNC))
+        return;
+    f[key_rx_len++] = c;
+    if (key_rx_len < FRAME_HEADER_BYTES)
+        return;
+
+    payload = f[4] | (f[5] << 8);
+    end = FRAME_HEADER_BYTES + payload;
+    if (key_rx_len == FRAME_HEADER_BYTES &&
+        (f[1] != FRAME_KEY_PROVISION || !payload || (payload & 1) ||
+         payload > KEY_FRAME_MAX_PAYLOAD)) {
+        key_rx_len = 0; // not for us
+    } else if (key_rx_len == end + FRAME_CRC_BYTES) {
+        if ((f[end] | (f[end + 1] << 8)) == crc16_ccitt(&f[1], end - 1))
+            key_rx_ready = true;
+        key_rx_len = 0;
+    }
+}
 
-    cyphertext_len = *CHAN_IN1(unsigned, cyphertext_len,
-                               CH(task_mult_block_get_result, task_print_cyphertext));
-    LOG("print cyphertext: len=%u\r\n", cyphertext_len);
+// Stores the key of the frame received, if any, and lets the receiver take
+// the next one. A frame not yet stored at a power failure is lost (it is in
+// RAM), as one still being received is.
+static void key_rx_store()
+{
+    const uint8_t *f = key_rx_frame;
+    unsigned bytes = (f[4] | (f[5] << 8)) / 2;
 
-    printf("Cyphertext:\r\n");
-    for (i = 0; i < cyphertext_len; ++i) {
-        c = *CHAN_IN1(digit_t, cyphertext[i], CH(task_mult_block_get_result, task_print_cyphertext));
-        printf("%02x ", c);
-        line[j++] = c;
-        if ((i + 1) % PRINT_HEX_ASCII_COLS == 0) {
-            printf(" ");
-            for (j = 0; j < PRINT_HEX_ASCII_COLS; ++j) {
-                c = line[j];
-                if (!(32 <= c && c <= 127)) // not printable
-                    c = '.';
-                printf("%c", c);
-            }
-            j = 0;
-            printf("\r\n");
-        }
+    if (!key_rx_ready)
+        return;
+    key_store_put(&f[FRAME_HEADER_BYTES], &f[FRAME_HEADER_BYTES + bytes], bytes);
+    key_rx_ready = false;
+}
+
+#if !defined(__MSP430__)
+// Host build: the provisioning frames come from a file, if there is one
+static void key_rx_file(const char *path)
+{
+    int c;
+    FILE *f = fopen(path, "rb");
+
+    if (!f)
+        return;
+    while ((c = fgetc(f)) != EOF) {
+        key_rx(c);
+        key_rx_store();
     }
-    printf("\r\n");
+    fclose(f);
+}
+#endif
+#endif // CONFIG_KEY_STORE
 
-#ifdef SHOW_COARSE_PROGRESS_ON_LED
-    blink(1, BLINK_MESSAGE_DONE, LED2);
+#ifndef PUBKEY
+#define PUBKEY pubkey
 #endif
-    while(1); 
-    TRANSITION_TO(task_init);
+
+#if defined(__MSP430__) && (CONFIG_STREAM_INPUT || CONFIG_KEY_STORE || !CONFIG_OUTPUT_HEX)
+// The console UART: receiver of the message (streaming input) or of keys to
+// provision, and transmitter of the output frames
+__attribute__ ((interrupt(USCI_A0_VECTOR)))
+void USCI_A0_ISR(void)
+{
+    switch (__even_in_range(UCA0IV, USCI_UART_UCTXCPTIFG)) {
+    case USCI_UART_UCRXIFG:
+#if CONFIG_STREAM_INPUT
+        stream_in_rx(UCA0RXBUF);
+        __bic_SR_register_on_exit(LPM0_bits); // wake up stream_in_wait
+#elif CONFIG_KEY_STORE
+        key_rx(UCA0RXBUF);
+#endif
+        break;
+#if !CONFIG_OUTPUT_HEX
+    case USCI_UART_UCTXIFG:
+        out_tx_ready();
+        break;
+    case USCI_UART_UCTXCPTIFG:
+        out_tx_complete();
+        __bic_SR_register_on_exit(LPM0_bits); // wake up out_write
+        break;
+#endif
+    }
 }
+#endif
 
-// TODO: this task also looks like a proxy: is it avoidable?
-void task_mult_mod()
+#if CONFIG_BENCH
+#if defined(__MSP430__)
+static volatile uint32_t bench_overflows; // of the 16-bit timer
+
+__attribute__ ((interrupt(TIMER0_A1_VECTOR)))
+void TIMER0_A1_ISR(void)
 {
-    int i;
-    digit_t a, b;
+    if (TA0IV == TAIV__TAIFG)
+        ++bench_overflows;
+}
 
-    LOG("mult mod\r\n");
+#if !CONFIG_OUTPUT_HEX
+// Cycles since bench_start, modulo 2^32
+static uint32_t bench_now()
+{
+    uint16_t count;
+    uint32_t overflows;
 
-    for (i = 0; i < NUM_DIGITS; ++i) {
-        a = *CHAN_IN1(digit_t, A[i], CALL_CH(ch_mult_mod));
-        b = *CHAN_IN1(digit_t, B[i], CALL_CH(ch_mult_mod));
+    do {
+        overflows = bench_overflows;
+        count = TA0R;
+    } while (overflows != bench_overflows);
+    return (overflows << 16) | count;
+}
+#endif
+#else
+#include <time.h>
+
+static clock_t bench_start_time;
+#endif
+
+static void bench_start()
+{
+#if defined(__MSP430__)
+    bench_overflows = 0;
+    TA0CTL = TASSEL__SMCLK | MC__CONTINUOUS | TACLR | TAIE;
+#else
+    bench_start_time = clock();
+#endif
+#if !CONFIG_OUTPUT_HEX
+    bench_out_wait = 0;
+#endif
+}
+
+// Reports the cycles since bench_start: 48 bits, as the timer count and the
+// count of its overflows; in a frame, followed by the cycles of out_write
+// waiting for room in the ring
+static void bench_report()
+{
+    uint16_t count;
+    uint32_t overflows;
+
+#if defined(__MSP430__)
+    do { // an overflow between the two reads is seen as a change of the count
+        overflows = bench_overflows;
+        count = TA0R;
+    } while (overflows != bench_overflows);
+    TA0CTL = MC__STOP;
+#else
+    clock_t ticks = clock() - bench_start_time;
+
+    count = ticks & 0xffff;
+    overflows = ticks >> 16;
+#endif
+
+#if CONFIG_OUTPUT_HEX
+    printf("Cycles: 0x%lx%04x\r\n", (unsigned long)overflows, count);
+#else
+    int i;
+
+    out_frame_begin(FRAME_BENCH, 0);
+    out_byte(count & 0xff);
+    out_byte(count >> 8);
+    for (i = 0; i < 4; ++i)
+        out_byte(overflows >> (8 * i));
+    for (i = 0; i < 4; ++i)
+        out_byte(bench_out_wait >> (8 * i));
+    out_frame_end();
+#endif
+}
+#endif // CONFIG_BENCH
+
+// Everything the mult-mod hypertask needs that depends only on the modulus,
+// derived once per key and kept in non-volatile memory across reboots. The
+// record is tagged with a hash of the modulus (and of the build parameters
+// that shape it), and only trusted while 'valid' is set: the flag is cleared
+// before the record is rewritten and set last, so a power failure in the
+// middle of the key setup leaves it invalid rather than inconsistent.
+struct key_record {
+    bool valid;
+    uint32_t hash;
+    digit_t n[MAX_DIGITS];
+#if CONFIG_REDUCE == REDUCE_SCHOOLBOOK
+    ddigit_t n_div;
+    digit_t n_recip;
+#elif CONFIG_REDUCE == REDUCE_MONTGOMERY
+    digit_t n_prime;
+    digit_t R2_mod_N[MAX_DIGITS];
+#elif CONFIG_REDUCE == REDUCE_BARRETT
+    digit_t mu[MAX_DIGITS + 1];
+#endif
+};
+
+// One record per modulus: the public one, or each of the two primes
+#if CONFIG_DECRYPT
+#define NUM_KEY_RECORDS 2
+#else
+#define NUM_KEY_RECORDS 1
+#endif
+
+#if CONFIG_KEY_RECORDS
+static __nv struct key_record key_records[NUM_KEY_RECORDS] = {
+#include "../data/keyrec.txt"
+};
+#else
+static __nv struct key_record key_records[NUM_KEY_RECORDS];
+#endif
+
+// FNV-1a over the modulus, seeded with the parameters of the build
+static uint32_t key_hash(const uint8_t *modulus)
+{
+    int i;
+    uint32_t h = 2166136261u;
+    const uint8_t params[] = { MODULUS_BITS >> 8, MODULUS_BITS & 0xff,
+                               DIGIT_BITS, CONFIG_REDUCE };
+
+    for (i = 0; i < sizeof(params); ++i)
+        h = (h ^ params[i]) * 16777619u;
+    for (i = 0; i < MODULUS_BYTES; ++i)
+        h = (h ^ modulus[i]) * 16777619u;
+    return h;
+}
+
+static void key_setup(struct key_record *key, const uint8_t *modulus)
+{
+    int i, j;
+    digit_t *n = key->n;
+
+    LOG_INFO("init: key setup\r\n");
+
+    // TODO: consider passing pubkey as a structure type
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        n[i] = 0;
+        for (j = DIGIT_BYTES - 1; j >= 0; --j) // key bytes are LSB first
+            n[i] = (n[i] << 8) | modulus[i * DIGIT_BYTES + j];
+    }
+
+#if CONFIG_REDUCE == REDUCE_SCHOOLBOOK
+    // The quotient digits are computed by dividing the top three digits of
+    // the remainder by the top two digits of N, which must be normalized
+    // (N >= b^k / 2, as for a full-length key).
+    if (!(n[NUM_DIGITS - 1] >> (DIGIT_BITS - 1))) {
+        printf("ERROR: modulus is shorter than %u bits\r\n", MODULUS_BITS);
+        while(1);
+    }
+
+    // Reciprocal of the divisor: floor((b^3 - 1) / n_div) - b
+    key->n_div = ((ddigit_t)n[NUM_DIGITS - 1] << DIGIT_BITS) | n[NUM_DIGITS - 2];
+    key->n_recip = ((((uint64_t)1 << (3 * DIGIT_BITS)) - 1) / key->n_div - DIGIT_BASE) & DIGIT_MASK;
+#elif CONFIG_REDUCE == REDUCE_MONTGOMERY
+    // n' = -N^-1 mod b, by Newton iteration x = x * (2 - N[0] * x) which
+    // doubles the number of correct low bits on each step (N is odd, so
+    // x = N[0] is a valid start with 3 correct bits).
+    digit_t n_inv = n[0];
+    for (i = 0; i < 4; ++i)
+        n_inv = MULT_DIGITS(n_inv, (2 - MULT_DIGITS(n[0], n_inv)) & DIGIT_MASK) & DIGIT_MASK;
+    key->n_prime = (-n_inv) & DIGIT_MASK;
+#endif
+
+    // In the Montgomery and Barrett modes, R^2 mod N or mu is left to the
+    // division hypertask (see task_init): it takes 2 * k * DIGIT_BITS
+    // modular doublings
+}
+
+// In the decryption mode, this task is entered again to switch the modulus
+// of the mult-mod hypertask to the other prime. It is also entered again by
+// task_key_done, once the key record is complete.
+void task_init()
+{
+    int i;
+    uint32_t hash;
+    struct key_record *key;
+#if CONFIG_DECRYPT
+    unsigned prime;
+    const uint8_t *modulus;
+#elif CONFIG_STREAM_INPUT
+    unsigned message_length = 0; // not known in advance
+    const uint8_t *modulus = PUBKEY.n;
+#else
+    unsigned message_length = sizeof(PLAINTEXT) - 1; // skip the terminating null byte
+    const uint8_t *modulus = PUBKEY.n;
+#endif
+
+    LOG_INFO("init\r\n");
+
+#if CONFIG_DECRYPT
+    prime = *CHAN_IN2(unsigned, prime, CH(task_crt_block, task_init), CH(task_crt_result, task_init));
+    if (prime == CRT_NONE) {
+#ifdef SHOW_COARSE_PROGRESS_ON_LED
+        blink(1, BLINK_DURATION_BOOT, LED1 | LED2);
+#endif
+#if CONFIG_BENCH
+        bench_start();
+#endif
+#if CONFIG_KEY_SIZE_RUNTIME
+        key_size_set(privkey.n);
+#endif
+        if (exp_is_zero(privkey.dp, MODULUS_BYTES) || exp_is_zero(privkey.dq, MODULUS_BYTES)) {
+            printf("ERROR: zero private exponent\r\n");
+            while(1);
+        }
+        printf("Private key: N = \r\n");
+        print_hex_ascii(privkey.n, KEY_SIZE_BYTES);
+
+        unsigned zero = 0;
+        CHAN_OUT1(unsigned, block_offset, zero, CH(task_init, task_crt_block));
+        TRANSITION_TO(task_crt_block);
+    }
+    modulus = (prime == CRT_P) ? privkey.p : privkey.q;
+    LOG_INFO("init: prime %u\r\n", prime);
+#else
+#ifdef SHOW_COARSE_PROGRESS_ON_LED
+    blink(1, BLINK_DURATION_BOOT, LED1 | LED2);
+#endif
+#if CONFIG_BENCH
+    bench_start();
+#endif
+
+#if CONFIG_KEY_STORE
+    struct key_slot *slot;
+
+    key_rx_store();
+    slot = key_store_newest();
+    key_current = slot ? slot->key : pubkey;
+    if (slot)
+        LOG_INFO("init: key slot %u serial %u\r\n", (unsigned)(slot - key_slots), slot->serial);
+#endif
+#if CONFIG_KEY_SIZE_RUNTIME
+    key_size_set(PUBKEY.n);
+#endif
+    if (exp_is_zero(PUBKEY.e, KEY_SIZE_BYTES)) {
+        printf("ERROR: zero public exponent\r\n");
+        while(1);
+    }
+#endif
+
+#if CONFIG_DECRYPT
+    key = &key_records[prime - CRT_P];
+#else
+    key = &key_records[0];
+#endif
+    hash = key_hash(modulus);
+    if (key->valid && key->hash == hash) {
+        LOG_INFO("init: key record %lx valid\r\n", (unsigned long)hash);
+    } else {
+        key->valid = false;
+        key_setup(key, modulus);
+        key->hash = hash;
+#if CONFIG_REDUCE == REDUCE_SCHOOLBOOK
+        key->valid = true;
+#endif
+    }
+
+    LOG_INFO("init: out modulus\r\n");
+
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        CHAN_OUT1(digit_t, N[i], key->n[i], MC_OUT_CH(ch_modulus, task_init,
+                 task_reduce_normalizable, task_reduce_normalize,
+                 task_reduce_quotient, task_reduce_subtract));
+    }
+
+#if CONFIG_REDUCE != REDUCE_SCHOOLBOOK
+    // The rest of the key setup is too long for one task: the division
+    // hypertask divides b^(2k) by N, for R^2 mod N (the remainder) or
+    // mu = floor(b^(2k) / N) (the quotient), and task_key_done completes the
+    // record and comes back here
+    if (!key->valid) {
+        digit_t one = 1;
+        unsigned len = 1, shift = 2 * NUM_DIGITS, first = 0, record = key - key_records;
+
+        CHAN_OUT1(digit_t, X[0], one, CALL_CH(ch_mod_n));
+        CHAN_OUT1(unsigned, len, len, CALL_CH(ch_mod_n));
+        CHAN_OUT1(unsigned, shift, shift, CALL_CH(ch_mod_n));
+        CHAN_OUT1(unsigned, digit, first, CALL_CH(ch_mod_n));
+        CHAN_OUT1(unsigned, record, record, CH(task_init, task_key_done));
+        const task_t *next_task = TASK_REF(task_key_done);
+        CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_mod_n));
+        TRANSITION_TO(task_mod_n);
+    }
+#endif
+
+#if !CONFIG_DECRYPT
+#if !CONFIG_OUTPUT_HEX
+    // The message is known to the receiver: only the key is reported
+    out_frame_begin(FRAME_KEY, 0);
+    for (i = 0; i < KEY_SIZE_BYTES; ++i)
+        out_byte(PUBKEY.e[i]);
+    for (i = 0; i < KEY_SIZE_BYTES; ++i)
+        out_byte(PUBKEY.n[i]);
+    out_frame_end();
+#else
+#if !CONFIG_STREAM_INPUT
+    printf("Message:\r\n"); print_hex_ascii(PLAINTEXT, message_length);
+#endif
+    printf("Public key: exp = \r\n");
+    print_hex_ascii(PUBKEY.e, KEY_SIZE_BYTES);
+    printf("N = \r\n");
+    print_hex_ascii(PUBKEY.n, KEY_SIZE_BYTES);
+#endif
+#endif
+
+#if CONFIG_REDUCE == REDUCE_SCHOOLBOOK
+    LOG_INFO("init: out divisor: n_div=%x n_recip=%x\r\n", key->n_div, key->n_recip);
+
+    CHAN_OUT1(ddigit_t, n_div, key->n_div, CH(task_init, task_reduce_quotient));
+    CHAN_OUT1(digit_t, n_recip, key->n_recip, CH(task_init, task_reduce_quotient));
+#elif CONFIG_REDUCE == REDUCE_MONTGOMERY
+    LOG_INFO("init: out montgomery constants: n'=%x\r\n", key->n_prime);
+
+    CHAN_OUT1(digit_t, n_prime, key->n_prime, MC_OUT_CH(ch_n_prime, task_init,
+             task_mont_reduce, task_mont_mult, task_mod_exp_done));
+
+    for (i = 0; i < NUM_DIGITS; ++i)
+        CHAN_OUT1(digit_t, R2_mod_N[i], key->R2_mod_N[i], CH(task_init, task_mod_exp));
+#elif CONFIG_REDUCE == REDUCE_BARRETT
+    LOG_INFO("init: out barrett constant\r\n");
+
+    for (i = 0; i <= NUM_DIGITS; ++i)
+        CHAN_OUT1(digit_t, mu[i], key->mu[i], CH(task_init, task_barrett_quotient));
+#endif
+
+#if CONFIG_DECRYPT
+    CHAN_OUT1(unsigned, prime, prime, MC_OUT_CH(ch_crt_prime, task_init,
+             task_crt_base, task_crt_result));
+    TRANSITION_TO(task_crt_reduce);
+#else
+    unsigned zero = 0;
+
+#if CONFIG_HYBRID
+    uint8_t session[SESSION_BYTES];
+
+    LOG_INFO("init: new session\r\n");
+    session_draw(session);
+    for (i = 0; i < SESSION_BYTES; ++i)
+        CHAN_OUT1(uint8_t, session[i], session[i], MC_OUT_CH(ch_session_key, task_init,
+                  task_pad, task_chacha));
+
+    CHAN_OUT1(unsigned, message_length, message_length, CH(task_init, task_chacha));
+    CHAN_OUT1(unsigned, block_offset, zero, CH(task_init, task_chacha));
+
+    message_length = SESSION_BYTES; // what RSA encrypts
+#endif
+
+    CHAN_OUT1(unsigned, block_offset, zero, CH(task_init, task_pad));
+    CHAN_OUT1(unsigned, cyphertext_len, zero, CH(task_init, task_save_block));
+
+    out_next_block = 0;
+#if CONFIG_OUTPUT_HEX
+    printf("Cyphertext:\r\n");
+#endif
+
+#if CONFIG_COMPRESS
+    unsigned start = LZ_HEADER_BYTES;
+    CHAN_OUT1(unsigned, message_length, message_length, CH(task_init, task_compress));
+    CHAN_OUT1(unsigned, in, zero, CH(task_init, task_compress));
+    CHAN_OUT1(unsigned, out, start, CH(task_init, task_compress));
+    CHAN_OUT1(unsigned, run, zero, CH(task_init, task_compress));
+    CHAN_OUT1(unsigned, literals, zero, CH(task_init, task_compress));
+
+    LOG_INFO("init: done\r\n");
+
+    TRANSITION_TO(task_compress);
+#else
+    CHAN_OUT1(unsigned, message_length, message_length, CH(task_init, task_pad));
+
+#if CONFIG_STREAM_INPUT
+    stream_in_reset();
+#endif
+
+    LOG_INFO("init: done\r\n");
+
+    TRANSITION_TO(task_pad);
+#endif
+#endif
+}
+
+#if CONFIG_REDUCE != REDUCE_SCHOOLBOOK || CONFIG_DECRYPT
+// Division hypertask: X * b^shift mod N by bit-serial long division, one
+// digit of the dividend (DIGIT_BITS modular doublings) per task, with the
+// partial remainder in a self channel. Returns the remainder in product[].
+// In the Barrett mode, each doubling that wraps around N is a one bit of the
+// quotient, whose low k+1 digits are returned in quotient[].
+void task_mod_n()
+{
+    int i, j;
+    unsigned len, shift, digit;
+    digit_t x, n[MAX_DIGITS], r[MAX_DIGITS + 1];
+#if CONFIG_REDUCE == REDUCE_BARRETT
+    digit_t q = 0;
+    unsigned q_digit;
+#endif
+
+    len = *CHAN_IN1(unsigned, len, CALL_CH(ch_mod_n));
+    shift = *CHAN_IN1(unsigned, shift, CALL_CH(ch_mod_n));
+    digit = *CHAN_IN2(unsigned, digit, CALL_CH(ch_mod_n), SELF_IN_CH(task_mod_n));
+
+    LOG_DEBUG("mod n: digit=%u of %u\r\n", digit, len + shift);
+
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        n[i] = *CHAN_IN1(digit_t, N[i], MC_IN_CH(ch_modulus, task_init, task_mod_n));
+        r[i] = digit ? *CHAN_IN1(digit_t, r[i], SELF_IN_CH(task_mod_n)) : 0;
+    }
+
+    // Digits of X from the top, then the zero digits of the shift
+    x = (digit < len) ? *CHAN_IN1(digit_t, X[len - 1 - digit], CALL_CH(ch_mod_n)) : 0;
+#if CONFIG_REDUCE == REDUCE_BARRETT
+    for (j = DIGIT_BITS - 1; j >= 0; --j)
+        q = (q << 1) | double_mod_n(r, n, (x >> j) & 0x1);
+    q_digit = len + shift - 1 - digit;
+#else
+    for (j = DIGIT_BITS - 1; j >= 0; --j)
+        double_mod_n(r, n, (x >> j) & 0x1);
+#endif
+
+    digit++;
+
+    if (digit < len + shift) {
+        for (i = 0; i < NUM_DIGITS; ++i)
+            CHAN_OUT1(digit_t, r[i], r[i], SELF_OUT_CH(task_mod_n));
+#if CONFIG_REDUCE == REDUCE_BARRETT
+        if (q_digit <= NUM_DIGITS)
+            CHAN_OUT1(digit_t, quotient[q_digit], q, SELF_OUT_CH(task_mod_n));
+#endif
+        CHAN_OUT1(unsigned, digit, digit, SELF_OUT_CH(task_mod_n));
+        TRANSITION_TO(task_mod_n);
+    }
+
+    for (i = 0; i < NUM_DIGITS; ++i)
+        CHAN_OUT1(digit_t, product[i], r[i], RET_CH(ch_mod_n));
+#if CONFIG_REDUCE == REDUCE_BARRETT
+    // The last digit is digit 0 of the quotient; those above the dividend
+    // are zero
+    for (i = 0; i <= NUM_DIGITS; ++i) {
+        if (i > 0)
+            q = (i < len + shift) ? *CHAN_IN1(digit_t, quotient[i], SELF_IN_CH(task_mod_n)) : 0;
+        CHAN_OUT1(digit_t, quotient[i], q, RET_CH(ch_mod_n));
+    }
+#endif
+
+    const task_t *next_task = *CHAN_IN1(task_t *, next_task, CALL_CH(ch_mod_n));
+    transition_to(next_task);
+}
+#endif
+
+#if CONFIG_REDUCE != REDUCE_SCHOOLBOOK
+// End of the key setup: the result of the division hypertask completes the
+// key record, which is then valid for task_init. Since N >= b^k / 2,
+// mu < 2 * b^k fits in the low k+1 digits of the quotient.
+void task_key_done()
+{
+    int i;
+    unsigned record;
+    struct key_record *key;
+
+    record = *CHAN_IN1(unsigned, record, CH(task_init, task_key_done));
+    key = &key_records[record];
+
+    LOG_INFO("key done: record %u\r\n", record);
+
+#if CONFIG_REDUCE == REDUCE_MONTGOMERY
+    for (i = 0; i < NUM_DIGITS; ++i)
+        key->R2_mod_N[i] = *CHAN_IN1(digit_t, product[i], RET_CH(ch_mod_n));
+#else
+    for (i = 0; i <= NUM_DIGITS; ++i)
+        key->mu[i] = *CHAN_IN1(digit_t, quotient[i], RET_CH(ch_mod_n));
+#endif
+    key->valid = true;
+
+    TRANSITION_TO(task_init);
+}
+#endif
+
+#if CONFIG_COMPRESS && !CONFIG_DECRYPT
+// LZSS pre-pass over PLAINTEXT, one chunk of input per task: each position is
+// coded as a match against the last CONFIG_COMPRESS_WINDOW bytes (longest
+// found, the oldest on a tie), or as a literal. The token byte of a literal
+// run is reserved when the run opens and written when it closes.
+void task_compress()
+{
+    int cand;
+    unsigned in, out, run, literals, message_length, end, len, best, dist;
+    uint8_t c;
+
+    message_length = *CHAN_IN1(unsigned, message_length, CH(task_init, task_compress));
+    in = *CHAN_IN2(unsigned, in, CH(task_init, task_compress), SELF_IN_CH(task_compress));
+    out = *CHAN_IN2(unsigned, out, CH(task_init, task_compress), SELF_IN_CH(task_compress));
+    run = *CHAN_IN2(unsigned, run, CH(task_init, task_compress), SELF_IN_CH(task_compress));
+    literals = *CHAN_IN2(unsigned, literals, CH(task_init, task_compress),
+                         SELF_IN_CH(task_compress));
+
+    LOG_DEBUG("compress: in=%u out=%u\r\n", in, out);
+
+    end = in + LZ_CHUNK;
+    if (end > message_length)
+        end = message_length;
+
+    while (in < end) {
+        best = dist = 0;
+        cand = (int)in - CONFIG_COMPRESS_WINDOW;
+        if (cand < 0)
+            cand = 0;
+        for (; cand < in && best < LZ_MAX_MATCH; ++cand) {
+            for (len = 0; len < LZ_MAX_MATCH && in + len < message_length &&
+                          PLAINTEXT[cand + len] == PLAINTEXT[in + len]; ++len);
+            if (len > best) {
+                best = len;
+                dist = in - cand;
+            }
+        }
+
+        if (best >= LZ_MIN_MATCH) {
+            if (literals) { // close the run
+                c = literals - 1;
+                CHAN_OUT1(uint8_t, compressed[run], c, CH(task_compress, task_pad));
+                literals = 0;
+            }
+            c = 0x80 | ((best - LZ_MIN_MATCH) << 3) | ((dist - 1) >> 8);
+            CHAN_OUT1(uint8_t, compressed[out], c, CH(task_compress, task_pad));
+            c = (dist - 1) & 0xff;
+            CHAN_OUT1(uint8_t, compressed[out + 1], c, CH(task_compress, task_pad));
+            out += 2;
+            in += best;
+        } else {
+            if (!literals) // open a run
+                run = out++;
+            CHAN_OUT1(uint8_t, compressed[out], PLAINTEXT[in], CH(task_compress, task_pad));
+            out++;
+            in++;
+            if (++literals == LZ_MAX_LITERALS) {
+                c = literals - 1;
+                CHAN_OUT1(uint8_t, compressed[run], c, CH(task_compress, task_pad));
+                literals = 0;
+            }
+        }
+    }
+
+    if (in < message_length) {
+        CHAN_OUT1(unsigned, in, in, SELF_OUT_CH(task_compress));
+        CHAN_OUT1(unsigned, out, out, SELF_OUT_CH(task_compress));
+        CHAN_OUT1(unsigned, run, run, SELF_OUT_CH(task_compress));
+        CHAN_OUT1(unsigned, literals, literals, SELF_OUT_CH(task_compress));
+        TRANSITION_TO(task_compress);
+    }
+
+    if (literals) {
+        c = literals - 1;
+        CHAN_OUT1(uint8_t, compressed[run], c, CH(task_compress, task_pad));
+    }
+    c = message_length & 0xff;
+    CHAN_OUT1(uint8_t, compressed[0], c, CH(task_compress, task_pad));
+    c = message_length >> 8;
+    CHAN_OUT1(uint8_t, compressed[1], c, CH(task_compress, task_pad));
+
+    LOG_INFO("compress: %u -> %u bytes\r\n", message_length, out);
+
+    CHAN_OUT1(unsigned, message_length, out, CH(task_compress, task_pad));
+    TRANSITION_TO(task_pad);
+}
+#endif // CONFIG_COMPRESS && !CONFIG_DECRYPT
+
+// Bytes that are encrypted with RSA
+#if CONFIG_HYBRID
+#define RSA_MESSAGE(i) *CHAN_IN1(uint8_t, session[i], MC_IN_CH(ch_session_key, task_init, task_pad))
+#elif CONFIG_COMPRESS && !CONFIG_DECRYPT
+#define RSA_MESSAGE(i) *CHAN_IN1(uint8_t, compressed[i], CH(task_compress, task_pad))
+#define RSA_MESSAGE_LENGTH CHAN_IN1(unsigned, message_length, CH(task_compress, task_pad))
+#elif CONFIG_STREAM_INPUT
+#define RSA_MESSAGE(i) STREAM_IN_BYTE(i)
+#else
+#define RSA_MESSAGE(i) PLAINTEXT[i]
+#endif
+
+#ifndef RSA_MESSAGE_LENGTH
+#define RSA_MESSAGE_LENGTH CHAN_IN1(unsigned, message_length, CH(task_init, task_pad))
+#endif
+
+void task_pad()
+{
+    int i, j;
+    unsigned block_offset, message_length, byte;
+    digit_t m;
+    uint8_t c;
+
+#ifdef SHOW_COARSE_PROGRESS_ON_LED
+    GPIO(PORT_LED_1, OUT) &= ~BIT(PIN_LED_1);
+#endif
+
+    block_offset = *CHAN_IN2(unsigned, block_offset, CH(task_init, task_pad),
+                                           SELF_IN_CH(task_pad));
+
+#if CONFIG_STREAM_INPUT
+    // The message ends with the first block that is not full
+    message_length = block_offset + stream_in_wait(block_offset, BLOCK_PAYLOAD_BYTES);
+#else
+    message_length = *RSA_MESSAGE_LENGTH;
+#endif
+
+    LOG_INFO("pad: len=%u offset=%u\r\n", message_length, block_offset);
+
+    if (block_offset >= message_length) {
+        LOG_INFO("pad: message done\r\n");
+#if CONFIG_HYBRID
+        TRANSITION_TO(task_chacha);
+#else
+        TRANSITION_TO(task_print_cyphertext);
+#endif
+    }
+#if CONFIG_STREAM_INPUT
+    if (block_offset / BLOCK_PAYLOAD_BYTES == STREAM_MAX_BLOCKS) {
+        printf("ERROR: message over %u bytes\r\n", (unsigned)(STREAM_MAX_BLOCKS * BLOCK_PAYLOAD_BYTES));
+        while(1);
+    }
+#endif
+
+    /*
+    LOG("process block: padded block at offset=%u: ", block_offset);
+    for (i = 0; i < NUM_PAD_BYTES; ++i)
+        LOG("%x ", PAD_BYTES[i]);
+    LOG("'");
+    for (i = BLOCK_PAYLOAD_BYTES - 1; i >= 0; --i)
+        LOG("%x ", PLAINTEXT[block_offset + i]);
+    LOG("\r\n");
+    */
+    // Digits are packed from the bytes of the padded block, LSB first.
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        m = 0;
+        for (j = DIGIT_BYTES - 1; j >= 0; --j) {
+            byte = i * DIGIT_BYTES + j;
+            if (byte >= BLOCK_PAYLOAD_BYTES)
+                c = PAD_BYTES[byte - BLOCK_PAYLOAD_BYTES];
+            else if (block_offset + byte < message_length)
+                c = RSA_MESSAGE(block_offset + byte);
+            else
+                c = 0xFF;
+            m = (m << 8) | c;
+        }
+        LOG_TRACE("For iteration %u m = %u \r\n",i,m); 
+        CHAN_OUT1(digit_t, base[i], m, CALL_CH(ch_mod_exp));
+    }
+
+    // The public exponent, packed as the block
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        m = 0;
+        for (j = DIGIT_BYTES - 1; j >= 0; --j)
+            m = (m << 8) | PUBKEY.e[i * DIGIT_BYTES + j];
+        CHAN_OUT1(digit_t, E[i], m, CALL_CH(ch_mod_exp));
+    }
+
+    block_offset += BLOCK_PAYLOAD_BYTES;
+    CHAN_OUT1(unsigned, block_offset, block_offset, SELF_OUT_CH(task_pad));
+
+#ifdef SHOW_COARSE_PROGRESS_ON_LED
+    GPIO(PORT_LED_1, OUT) |= BIT(PIN_LED_1);
+#endif
+    const task_t *next_task = TASK_REF(task_save_block);
+    CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_mod_exp));
+    TRANSITION_TO(task_mod_exp);
+}
+
+// Modular exponentiation hypertask: base^E mod N, returned to the caller's
+// next task. In the Montgomery mode, the base first enters the Montgomery
+// domain by a multiplication with R^2 mod N.
+void task_mod_exp()
+{
+    LOG_INFO("mod exp\r\n");
+
+#if CONFIG_REDUCE == REDUCE_MONTGOMERY
+    int i;
+    digit_t m;
+
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        m = *CHAN_IN1(digit_t, base[i], CALL_CH(ch_mod_exp));
+        CHAN_OUT1(digit_t, A[i], m, CALL_CH(ch_mult_mod));
+        m = *CHAN_IN1(digit_t, R2_mod_N[i], CH(task_init, task_mod_exp));
+        CHAN_OUT1(digit_t, B[i], m, CALL_CH(ch_mult_mod));
+    }
+
+    const task_t *next_task = TASK_REF(task_mod_exp_base);
+    CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_mult_mod));
+    TRANSITION_TO(task_mult_mod);
+#else
+    TRANSITION_TO(task_mod_exp_base);
+#endif
+}
+
+#if !CONFIG_EXP_SLIDING_WINDOW
+// Moves the cursor to the next lower bit of the exponent; past bit 0 of
+// digit 0, the digit index goes negative.
+static void exp_next_bit(int *word, int *bit)
+{
+    if (--*bit < 0) {
+        --*word;
+        *bit = DIGIT_BITS - 1;
+    }
+}
+#endif
+
+// Base of the exponentiation, which is also the initial accumulator since it
+// accounts for the leading one of the exponent. Exponents that the chain is
+// built for go to the chain, all others to the loop.
+void task_mod_exp_base()
+{
+    int i;
+    digit_t b, e[MAX_DIGITS];
+
+    for (i = 0; i < NUM_DIGITS; ++i) {
+#if CONFIG_REDUCE == REDUCE_MONTGOMERY
+        b = *CHAN_IN1(digit_t, product[i], RET_CH(ch_mult_mod));
+#else
+        b = *CHAN_IN1(digit_t, base[i], CALL_CH(ch_mod_exp));
+#endif
+        CHAN_OUT1(digit_t, base[i], b, MC_OUT_CH(ch_exp_base, task_mod_exp_base,
+                  task_exp, task_exp_chain, task_mod_exp_done));
+        CHAN_OUT1(digit_t, product[i], b, MC_OUT_CH(ch_exp_base, task_mod_exp_base,
+                  task_exp, task_exp_chain, task_mod_exp_done));
+        e[i] = *CHAN_IN1(digit_t, E[i], CALL_CH(ch_mod_exp));
+    }
+
+#if CONFIG_EXP_CHAIN
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        b = (i * DIGIT_BITS < 32) ?
+            ((uint32_t)CONFIG_EXP_CHAIN >> (i * DIGIT_BITS)) & DIGIT_MASK : 0;
+        if (e[i] != b)
+            break;
+    }
+    if (i == NUM_DIGITS) {
+        LOG_DEBUG("mod exp base: chain\r\n");
+        unsigned first = 0;
+        CHAN_OUT1(unsigned, step, first, CH(task_mod_exp_base, task_exp_chain));
+        TRANSITION_TO(task_exp_chain);
+    }
+#endif
+
+#if !CONFIG_EXP_SLIDING_WINDOW
+    int word, bit;
+
+    // E > 0: a zero exponent is rejected by task_init
+
+    for (word = NUM_DIGITS - 1; word > 0 && !e[word]; --word);
+    for (bit = DIGIT_BITS - 1; bit > 0 && !((e[word] >> bit) & 0x1); --bit);
+    exp_next_bit(&word, &bit); // skip the leading one
+
+    LOG_DEBUG("mod exp base: word=%i bit=%i\r\n", word, bit);
+
+    if (word < 0) // E = 1
+        TRANSITION_TO(task_mod_exp_done);
+
+    bool multiply = false;
+    CHAN_OUT1(int, word, word, CH(task_mod_exp_base, task_exp));
+    CHAN_OUT1(int, bit, bit, CH(task_mod_exp_base, task_exp));
+    CHAN_OUT1(bool, multiply, multiply, CH(task_mod_exp_base, task_exp));
+#endif
+
+    TRANSITION_TO(task_exp);
+}
+
+#if CONFIG_EXP_CHAIN
+// Straight-line exponentiation by the fixed exponent 2^k + 1: k squarings of
+// the base, then a multiplication by the base, each a call that returns here
+void task_exp_chain()
+{
+    int i;
+    digit_t a, b;
+    unsigned step;
+
+    step = *CHAN_IN2(unsigned, step, CH(task_mod_exp_base, task_exp_chain),
+                     SELF_IN_CH(task_exp_chain));
+
+    LOG_DEBUG("exp chain: step=%u\r\n", step);
+
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        b = *CHAN_IN1(digit_t, base[i], MC_IN_CH(ch_exp_base, task_mod_exp_base, task_exp_chain));
+        a = step ? *CHAN_IN1(digit_t, product[i], RET_CH(ch_mult_mod)) : b;
+
+        if (step < EXP_CHAIN_SQUARES) {
+            CHAN_OUT1(digit_t, A[i], a, CALL_CH(ch_sqr_mod));
+        } else {
+            CHAN_OUT1(digit_t, A[i], a, CALL_CH(ch_mult_mod));
+            CHAN_OUT1(digit_t, B[i], b, CALL_CH(ch_mult_mod));
+        }
+    }
+
+    if (step < EXP_CHAIN_SQUARES) {
+        step++;
+        CHAN_OUT1(unsigned, step, step, SELF_OUT_CH(task_exp_chain));
+        const task_t *next_task = TASK_REF(task_exp_chain);
+        CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_sqr_mod));
+        TRANSITION_TO(task_sqr_mod);
+    }
+
+    const task_t *next_task = TASK_REF(task_mod_exp_done);
+    CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_mult_mod));
+    TRANSITION_TO(task_mult_mod);
+}
+#endif // CONFIG_EXP_CHAIN
+
+#if CONFIG_EXP_SLIDING_WINDOW
+#define EXP_BIT(e, bit) (((e)[(bit) / DIGIT_BITS] >> ((bit) % DIGIT_BITS)) & 0x1)
+
+// Window of the exponent whose most significant bit is the given bit: a zero
+// bit on its own, or the longest run of at most CONFIG_EXP_WINDOW_BITS bits
+// that ends with a one. Returns the width and the (odd) value of the window.
+// Only the digits of e that hold these bits are accessed.
+static unsigned exp_window(const digit_t *e, int bit, unsigned *value)
+{
+    int low, i;
+
+    if (!EXP_BIT(e, bit)) {
+        *value = 0;
+        return 1;
+    }
+
+    low = bit - CONFIG_EXP_WINDOW_BITS + 1;
+    if (low < 0)
+        low = 0;
+    while (!EXP_BIT(e, low))
+        ++low;
+
+    *value = 0;
+    for (i = bit; i >= low; --i)
+        *value = (*value << 1) | EXP_BIT(e, i);
+    return bit - low + 1;
+}
+
+// Start of the left-to-right sliding window exponentiation: sizes the table
+// of odd powers for the largest window of the exponent and squares the base
+// for building it.
+void task_exp()
+{
+    int i, bit;
+    digit_t e[MAX_DIGITS], b;
+    unsigned value, size = 1;
+
+    for (i = 0; i < NUM_DIGITS; ++i)
+        e[i] = *CHAN_IN1(digit_t, E[i], CALL_CH(ch_mod_exp));
+
+    // The scan for the top bit stops at bit 0 even for E = 0, which is
+    // rejected before any exponentiation (see task_init)
+    for (bit = NUM_DIGITS * DIGIT_BITS - 1; bit > 0 && !EXP_BIT(e, bit); --bit);
+
+    int first_bit = bit;
+    while (bit >= 0) {
+        bit -= exp_window(e, bit, &value);
+        if (value / 2 + 1 > size)
+            size = value / 2 + 1;
+    }
+    LOG_DEBUG("exp: top bit=%i table size=%u\r\n", first_bit, size);
+
+    bool one = true;
+    unsigned no_squares = 0;
+    int no_mult = EXP_NO_MULT;
+    CHAN_OUT1(int, bit, first_bit, CH(task_exp, task_exp_window));
+    CHAN_OUT1(unsigned, squares, no_squares, CH(task_exp, task_exp_window));
+    CHAN_OUT1(int, index, no_mult, CH(task_exp, task_exp_window));
+    CHAN_OUT1(bool, one, one, CH(task_exp, task_exp_window));
+
+    unsigned first = 0;
+    CHAN_OUT1(unsigned, size, size, CH(task_exp, task_exp_table));
+    CHAN_OUT1(unsigned, index, first, CH(task_exp, task_exp_table));
+
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        b = *CHAN_IN1(digit_t, base[i], MC_IN_CH(ch_exp_base, task_mod_exp_base, task_exp));
+        CHAN_OUT1(digit_t, base[i], b, CH(task_exp, task_exp_table));
+        if (size > 1)
+            CHAN_OUT1(digit_t, A[i], b, CALL_CH(ch_sqr_mod));
+    }
+
+    if (size > 1) {
+        const task_t *next_task = TASK_REF(task_exp_table);
+        CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_sqr_mod));
+        TRANSITION_TO(task_sqr_mod);
+    } else {
+        TRANSITION_TO(task_exp_table);
+    }
+}
+
+// Table of odd powers of the base: one entry per step, each the previous
+// entry times the square of the base
+void task_exp_table()
+{
+    int i;
+    digit_t a, b;
+    unsigned index, size;
+
+    index = *CHAN_IN2(unsigned, index, CH(task_exp, task_exp_table), SELF_IN_CH(task_exp_table));
+    size = *CHAN_IN1(unsigned, size, CH(task_exp, task_exp_table));
+
+    LOG_DEBUG("exp table: index=%u size=%u\r\n", index, size);
+
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        if (index == 0) {
+            a = *CHAN_IN1(digit_t, base[i], CH(task_exp, task_exp_table));
+            if (size > 1) {
+                b = *CHAN_IN1(digit_t, product[i], RET_CH(ch_mult_mod));
+                CHAN_OUT1(digit_t, base_sq[i], b, SELF_OUT_CH(task_exp_table));
+            }
+        } else {
+            a = *CHAN_IN1(digit_t, product[i], RET_CH(ch_mult_mod));
+            b = *CHAN_IN1(digit_t, base_sq[i], SELF_IN_CH(task_exp_table));
+        }
+        CHAN_OUT1(digit_t, T[index * NUM_DIGITS + i], a, CH(task_exp_table, task_exp_window));
+
+        if (index + 1 < size) {
+            CHAN_OUT1(digit_t, A[i], a, CALL_CH(ch_mult_mod));
+            CHAN_OUT1(digit_t, B[i], b, CALL_CH(ch_mult_mod));
+        }
+    }
+
+    index++;
+    if (index < size) {
+        CHAN_OUT1(unsigned, index, index, SELF_OUT_CH(task_exp_table));
+        const task_t *next_task = TASK_REF(task_exp_table);
+        CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_mult_mod));
+        TRANSITION_TO(task_mult_mod);
+    }
+
+    TRANSITION_TO(task_exp_window);
+}
+
+// Left-to-right scan of the exponent, one window at a time: the squarings
+// and the multiplication by a table entry of a window are calls that return
+// to this task, so every window begins at a task boundary.
+void task_exp_window()
+{
+    int i, bit, low, index;
+    unsigned squares, value;
+    bool one;
+    digit_t e[MAX_DIGITS], a;
+
+    bit = *CHAN_IN2(int, bit, CH(task_exp, task_exp_window), SELF_IN_CH(task_exp_window));
+    squares = *CHAN_IN2(unsigned, squares, CH(task_exp, task_exp_window),
+                        SELF_IN_CH(task_exp_window));
+    index = *CHAN_IN2(int, index, CH(task_exp, task_exp_window), SELF_IN_CH(task_exp_window));
+    one = *CHAN_IN2(bool, one, CH(task_exp, task_exp_window), SELF_IN_CH(task_exp_window));
+
+    LOG_DEBUG("exp window: bit=%i squares=%u index=%i one=%u\r\n", bit, squares, index, one);
+
+    if (squares == 0 && index == EXP_NO_MULT) { // window done
+        if (bit < 0) { // block done
+            for (i = 0; i < NUM_DIGITS; ++i) {
+                a = *CHAN_IN2(digit_t, product[i], RET_CH(ch_mult_mod), SELF_IN_CH(task_exp_window));
+                CHAN_OUT1(digit_t, product[i], a,
+                          CH(task_exp_window, task_mod_exp_done));
+            }
+            TRANSITION_TO(task_mod_exp_done);
+        }
+
+        low = bit - CONFIG_EXP_WINDOW_BITS + 1; // digits the window can span
+        if (low < 0)
+            low = 0;
+        for (i = low / DIGIT_BITS; i <= bit / DIGIT_BITS; ++i)
+            e[i] = *CHAN_IN1(digit_t, E[i], CALL_CH(ch_mod_exp));
+
+        squares = exp_window(e, bit, &value);
+        bit -= squares;
+        index = value ? value / 2 : EXP_NO_MULT;
+
+        if (one) { // the accumulator is 1: load it with the table entry
+            for (i = 0; i < NUM_DIGITS; ++i) {
+                a = *CHAN_IN1(digit_t, T[index * NUM_DIGITS + i],
+                              CH(task_exp_table, task_exp_window));
+                CHAN_OUT1(digit_t, product[i], a, SELF_OUT_CH(task_exp_window));
+            }
+            one = false;
+            squares = 0;
+            index = EXP_NO_MULT;
+            CHAN_OUT1(bool, one, one, SELF_OUT_CH(task_exp_window));
+            CHAN_OUT1(int, bit, bit, SELF_OUT_CH(task_exp_window));
+            CHAN_OUT1(unsigned, squares, squares, SELF_OUT_CH(task_exp_window));
+            CHAN_OUT1(int, index, index, SELF_OUT_CH(task_exp_window));
+            TRANSITION_TO(task_exp_window);
+        }
+        CHAN_OUT1(int, bit, bit, SELF_OUT_CH(task_exp_window));
+        CHAN_OUT1(bool, one, one, SELF_OUT_CH(task_exp_window));
+    }
+
+    const task_t *next_task = TASK_REF(task_exp_window);
+    if (squares > 0) {
+        for (i = 0; i < NUM_DIGITS; ++i) {
+            a = *CHAN_IN2(digit_t, product[i], RET_CH(ch_mult_mod), SELF_IN_CH(task_exp_window));
+            CHAN_OUT1(digit_t, A[i], a, CALL_CH(ch_sqr_mod));
+        }
+        squares--;
+        CHAN_OUT1(unsigned, squares, squares, SELF_OUT_CH(task_exp_window));
+        CHAN_OUT1(int, index, index, SELF_OUT_CH(task_exp_window));
+        CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_sqr_mod));
+        TRANSITION_TO(task_sqr_mod);
+    }
+
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        a = *CHAN_IN2(digit_t, product[i], RET_CH(ch_mult_mod), SELF_IN_CH(task_exp_window));
+        CHAN_OUT1(digit_t, A[i], a, CALL_CH(ch_mult_mod));
+        a = *CHAN_IN1(digit_t, T[index * NUM_DIGITS + i], CH(task_exp_table, task_exp_window));
+        CHAN_OUT1(digit_t, B[i], a, CALL_CH(ch_mult_mod));
+    }
+    index = EXP_NO_MULT;
+    CHAN_OUT1(unsigned, squares, squares, SELF_OUT_CH(task_exp_window));
+    CHAN_OUT1(int, index, index, SELF_OUT_CH(task_exp_window));
+    CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_mult_mod));
+    TRANSITION_TO(task_mult_mod);
+}
+#else // !CONFIG_EXP_SLIDING_WINDOW
+// Accumulator of the binary loop: the base until the first call returns
+#define EXP_ACC(i) CHAN_IN2(digit_t, product[i], RET_CH(ch_mult_mod), \
+                            MC_IN_CH(ch_exp_base, task_mod_exp_base, task_exp))
+
+// Left-to-right binary exponentiation: for each bit of the exponent, square
+// the accumulator and, if the bit is set, multiply it by the base, each a
+// call that returns here, or after the last bit to the end of the hypertask.
+void task_exp()
+{
+    int i, word, bit;
+    bool multiply, square;
+    digit_t a, b, e;
+
+    word = *CHAN_IN2(int, word, CH(task_mod_exp_base, task_exp), SELF_IN_CH(task_exp));
+    bit = *CHAN_IN2(int, bit, CH(task_mod_exp_base, task_exp), SELF_IN_CH(task_exp));
+    multiply = *CHAN_IN2(bool, multiply, CH(task_mod_exp_base, task_exp),
+                         SELF_IN_CH(task_exp));
+
+    LOG_DEBUG("exp: word=%i bit=%i multiply=%u\r\n", word, bit, multiply);
+
+    square = !multiply;
+    if (square) {
+        for (i = 0; i < NUM_DIGITS; ++i) {
+            a = *EXP_ACC(i);
+            CHAN_OUT1(digit_t, A[i], a, CALL_CH(ch_sqr_mod));
+        }
+
+        e = *CHAN_IN1(digit_t, E[word], CALL_CH(ch_mod_exp));
+        multiply = (e >> bit) & 0x1;
+    } else {
+        for (i = 0; i < NUM_DIGITS; ++i) {
+            a = *EXP_ACC(i);
+            b = *CHAN_IN1(digit_t, base[i], MC_IN_CH(ch_exp_base, task_mod_exp_base, task_exp));
+            CHAN_OUT1(digit_t, A[i], a, CALL_CH(ch_mult_mod));
+            CHAN_OUT1(digit_t, B[i], b, CALL_CH(ch_mult_mod));
+        }
+        multiply = false;
+    }
+
+    if (!multiply) // bit done
+        exp_next_bit(&word, &bit);
+    CHAN_OUT1(int, word, word, SELF_OUT_CH(task_exp));
+    CHAN_OUT1(int, bit, bit, SELF_OUT_CH(task_exp));
+    CHAN_OUT1(bool, multiply, multiply, SELF_OUT_CH(task_exp));
+
+    const task_t *next_task = (!multiply && word < 0) ?
+        TASK_REF(task_mod_exp_done) : TASK_REF(task_exp);
+    if (square) {
+        CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_sqr_mod));
+        TRANSITION_TO(task_sqr_mod);
+    }
+    CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_mult_mod));
+    TRANSITION_TO(task_mult_mod);
+}
+#endif // !CONFIG_EXP_SLIDING_WINDOW
+
+// The sliding window hands over the result on its own channel; everything
+// else returns it from the last multiplication, or, without one (E = 1),
+// it is the base itself.
+#if CONFIG_EXP_SLIDING_WINDOW
+#define EXP_RESULT(i) CHAN_IN2(digit_t, product[i], RET_CH(ch_mult_mod), \
+                               CH(task_exp_window, task_mod_exp_done))
+#else
+#define EXP_RESULT(i) CHAN_IN2(digit_t, product[i], RET_CH(ch_mult_mod), \
+                               MC_IN_CH(ch_exp_base, task_mod_exp_base, task_mod_exp_done))
+#endif
+
+// End of the exponentiation: the result leaves the Montgomery domain and is
+// returned to the caller
+void task_mod_exp_done()
+{
+    int i;
+    digit_t t[MAX_DIGITS + 2];
+#if CONFIG_REDUCE == REDUCE_MONTGOMERY
+    int d;
+    unsigned k = NUM_DIGITS; // the bound of every loop, read once
+    digit_t n[MAX_DIGITS];
+    digit_t n_prime;
+#endif
+
+    LOG_INFO("mod exp done\r\n");
+
+    for (i = 0; i < NUM_DIGITS; ++i)
+        t[i] = *EXP_RESULT(i);
+
+#if CONFIG_REDUCE == REDUCE_MONTGOMERY
+    // result * R^-1 mod N, i.e. REDC of the result (extended with zeros).
+    // Each step adds the multiple of N that clears the least significant
+    // digit and shifts down by one digit. Digit 0 of N is loaded outside the
+    // loop as in task_mont_mult.
+    n_prime = *CHAN_IN1(digit_t, n_prime, MC_IN_CH(ch_n_prime, task_init, task_mod_exp_done));
+    n[0] = *CHAN_IN1(digit_t, N[0], MC_IN_CH(ch_modulus, task_init, task_mod_exp_done));
+    for (i = 1; i < k; ++i)
+        n[i] = *CHAN_IN1(digit_t, N[i], MC_IN_CH(ch_modulus, task_init, task_mod_exp_done));
+    t[k] = t[k + 1] = 0;
+
+    for (d = 0; d < k; ++d)
+        mont_redc_step(t, n, n_prime, k);
+
+    sub_n_if_ge(t, n, k);
+#endif
+
+    for (i = 0; i < NUM_DIGITS; ++i)
+        CHAN_OUT1(digit_t, product[i], t[i], RET_CH(ch_mod_exp));
+
+    const task_t *next_task = *CHAN_IN1(task_t *, next_task, CALL_CH(ch_mod_exp));
+    transition_to(next_task);
+}
+
+// Result of the exponentiation of a block: its bytes are printed as the next
+// block of cyphertext
+void task_save_block()
+{
+    int i, j;
+    digit_t m;
+    unsigned cyphertext_len, block;
+
+    // TODO: current implementation restricts us to send only to the next instantiation
+    // of self, so for now, as a workaround, we proxy the value in every instantiation
+    cyphertext_len = *CHAN_IN2(unsigned, cyphertext_len, CH(task_init, task_save_block),
+                               SELF_IN_CH(task_save_block));
+    block = cyphertext_len / KEY_SIZE_BYTES;
+    LOG_INFO("save block: cyphertext len=%u\r\n", cyphertext_len);
+
+    if (out_block_begin(block)) {
+        for (i = 0; i < NUM_DIGITS; ++i) {
+            m = *CHAN_IN1(digit_t, product[i], RET_CH(ch_mod_exp));
+            for (j = 0; j < DIGIT_BYTES; ++j) // LSB first
+                out_byte(m >> (8 * j));
+        }
+        out_block_end(block);
+    }
+    cyphertext_len += KEY_SIZE_BYTES;
+
+    // TODO: implementation limitation: cannot multicast and send to self
+    // in the same macro
+    CHAN_OUT1(unsigned, cyphertext_len, cyphertext_len, SELF_OUT_CH(task_save_block));
+    CHAN_OUT1(unsigned, cyphertext_len, cyphertext_len,
+             CH(task_save_block, task_print_cyphertext));
+
+    LOG_INFO("save block: block done, cyphertext_len=%u\r\n", cyphertext_len);
+    TRANSITION_TO(task_pad);
+}
+
+#if CONFIG_HYBRID
+// Bulk encryption of the message, after the session key: each instance XORs
+// one block of ChaCha20 keystream (block counter = offset / 64, under the key
+// and nonce of the session) into the next 64 bytes, which are printed after
+// the RSA blocks of the session.
+void task_chacha()
+{
+    int i;
+    unsigned block_offset, message_length, cyphertext_len, block;
+    uint8_t session[SESSION_BYTES], keystream[CHACHA_BLOCK_BYTES], c;
+
+    block_offset = *CHAN_IN2(unsigned, block_offset, CH(task_init, task_chacha),
+                             SELF_IN_CH(task_chacha));
+    message_length = *CHAN_IN1(unsigned, message_length, CH(task_init, task_chacha));
+
+    LOG_INFO("chacha: len=%u offset=%u\r\n", message_length, block_offset);
+
+    if (block_offset >= message_length) {
+        cyphertext_len = WRAPPED_KEY_SIZE + message_length;
+        CHAN_OUT1(unsigned, cyphertext_len, cyphertext_len,
+                  CH(task_chacha, task_print_cyphertext));
+        TRANSITION_TO(task_print_cyphertext);
+    }
+
+    // Output blocks are numbered on from the RSA blocks of the key
+    block = NUM_SESSION_KEY_BLOCKS + block_offset / CHACHA_BLOCK_BYTES;
+    if (out_block_begin(block)) {
+        for (i = 0; i < SESSION_BYTES; ++i)
+            session[i] = *CHAN_IN1(uint8_t, session[i], MC_IN_CH(ch_session_key, task_init, task_chacha));
+        chacha_block(keystream, session, block_offset / CHACHA_BLOCK_BYTES,
+                     &session[CHACHA_KEY_BYTES]);
+
+        for (i = 0; i < CHACHA_BLOCK_BYTES && block_offset + i < message_length; ++i) {
+            c = PLAINTEXT[block_offset + i] ^ keystream[i];
+            out_byte(c);
+        }
+        out_block_end(block);
+    }
+
+    block_offset += CHACHA_BLOCK_BYTES;
+    CHAN_OUT1(unsigned, block_offset, block_offset, SELF_OUT_CH(task_chacha));
+    TRANSITION_TO(task_chacha);
+}
+#endif // CONFIG_HYBRID
+
+// End of the message: the blocks of cyphertext have all been printed, by
+// task_save_block and, in the hybrid mode, task_chacha
+void task_print_cyphertext()
+{
+    unsigned cyphertext_len;
+
+#if CONFIG_HYBRID
+    cyphertext_len = *CHAN_IN2(unsigned, cyphertext_len,
+                               CH(task_save_block, task_print_cyphertext),
+                               CH(task_chacha, task_print_cyphertext));
+#else
+    cyphertext_len = *CHAN_IN1(unsigned, cyphertext_len,
+                               CH(task_save_block, task_print_cyphertext));
+#endif
+    LOG_INFO("print cyphertext: len=%u\r\n", cyphertext_len);
+
+#if CONFIG_OUTPUT_HEX
+    printf("Cyphertext length: %u\r\n", cyphertext_len);
+#else
+    out_frame_begin(FRAME_END, out_next_block);
+    out_byte(cyphertext_len & 0xff);
+    out_byte(cyphertext_len >> 8);
+    out_frame_end();
+#endif
+#if CONFIG_BENCH
+    bench_report();
+#endif
+
+#ifdef SHOW_COARSE_PROGRESS_ON_LED
+    blink(1, BLINK_MESSAGE_DONE, LED2);
+#endif
+    while(1); 
+    TRANSITION_TO(task_init);
+}
+
+#if CONFIG_DECRYPT
+// Decryption, one block at a time: m_q = c^dq mod q and m_p = c^dp mod p,
+// each by the modular exponentiation hypertask at half width with the
+// mult-mod hypertask switched to the respective prime (by task_init), then Garner's
+// recombination m = m_q + q * ((m_p - m_q) * qinv mod p).
+void task_crt_block()
+{
+    unsigned block_offset, decrypted_len;
+
+    block_offset = *CHAN_IN2(unsigned, block_offset, CH(task_init, task_crt_block),
+                             CH(task_crt_garner, task_crt_block));
+
+    LOG_INFO("crt block: offset=%u\r\n", block_offset);
+
+    if (block_offset >= sizeof(CYPHERTEXT)) {
+        decrypted_len = block_offset / KEY_SIZE_BYTES * BLOCK_PAYLOAD_BYTES;
+        CHAN_OUT1(unsigned, decrypted_len, decrypted_len,
+                  CH(task_crt_block, task_print_decrypted));
+        TRANSITION_TO(task_print_decrypted);
+    }
+
+#ifdef SHOW_COARSE_PROGRESS_ON_LED
+    GPIO(PORT_LED_1, OUT) &= ~BIT(PIN_LED_1);
+#endif
+
+    CHAN_OUT1(unsigned, block_offset, block_offset, MC_OUT_CH(ch_crt_block, task_crt_block,
+              task_crt_reduce, task_crt_garner));
+
+    unsigned prime = CRT_Q;
+    CHAN_OUT1(unsigned, prime, prime, CH(task_crt_block, task_init));
+    TRANSITION_TO(task_init);
+}
+
+// Base of the exponentiation: the cyphertext block, reduced modulo the prime
+// by the division hypertask
+void task_crt_reduce()
+{
+    int i;
+    unsigned block_offset, len = 2 * NUM_DIGITS, shift = 0, first = 0;
+    digit_t c[MAX_DIGITS * 2];
+
+    block_offset = *CHAN_IN1(unsigned, block_offset,
+                             MC_IN_CH(ch_crt_block, task_crt_block, task_crt_reduce));
+
+    LOG_INFO("crt reduce: offset=%u\r\n", block_offset);
+
+    unpack_digits(c, &CYPHERTEXT[block_offset], NUM_DIGITS * 2);
+    for (i = 0; i < NUM_DIGITS * 2; ++i)
+        CHAN_OUT1(digit_t, X[i], c[i], CALL_CH(ch_mod_n));
+    CHAN_OUT1(unsigned, len, len, CALL_CH(ch_mod_n));
+    CHAN_OUT1(unsigned, shift, shift, CALL_CH(ch_mod_n));
+    CHAN_OUT1(unsigned, digit, first, CALL_CH(ch_mod_n));
+
+    const task_t *next_task = TASK_REF(task_crt_base);
+    CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_mod_n));
+    TRANSITION_TO(task_mod_n);
+}
+
+// The reduced block raised to dp or dq by the modular exponentiation hypertask
+void task_crt_base()
+{
+    int i;
+    unsigned prime;
+    digit_t r, e[MAX_DIGITS];
+
+    prime = *CHAN_IN1(unsigned, prime, MC_IN_CH(ch_crt_prime, task_init, task_crt_base));
+
+    LOG_INFO("crt base: prime=%u\r\n", prime);
+
+    unpack_digits(e, (prime == CRT_P) ? privkey.dp : privkey.dq, NUM_DIGITS);
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        r = *CHAN_IN1(digit_t, product[i], RET_CH(ch_mod_n));
+        CHAN_OUT1(digit_t, base[i], r, CALL_CH(ch_mod_exp));
+        CHAN_OUT1(digit_t, E[i], e[i], CALL_CH(ch_mod_exp));
+    }
+
+    const task_t *next_task = TASK_REF(task_crt_result);
+    CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_mod_exp));
+    TRANSITION_TO(task_mod_exp);
+}
+
+// Result of an exponentiation: m_q is kept while the hypertask is switched to
+// p; with m_p, the first step of the recombination is h = (m_p - m_q) * qinv
+// mod p, where m_p - m_q is taken as m_p + 2p - m_q >= 0 (q < 2p) and reduced
+// mod p first.
+void task_crt_result()
+{
+    int i;
+    unsigned prime;
+    digit_t m, mq, n, x;
+    int32_t acc;
+
+    prime = *CHAN_IN1(unsigned, prime, MC_IN_CH(ch_crt_prime, task_init, task_crt_result));
+
+    LOG_INFO("crt result: prime=%u\r\n", prime);
+
+    if (prime == CRT_Q) {
+        for (i = 0; i < NUM_DIGITS; ++i) {
+            m = *CHAN_IN1(digit_t, product[i], RET_CH(ch_mod_exp));
+            CHAN_OUT1(digit_t, mq[i], m, SELF_OUT_CH(task_crt_result));
+            CHAN_OUT1(digit_t, mq[i], m, CH(task_crt_result, task_crt_garner));
+        }
+
+        prime = CRT_P;
+        CHAN_OUT1(unsigned, prime, prime, CH(task_crt_result, task_init));
+        TRANSITION_TO(task_init);
+    }
+
+    acc = 0;
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        n = *CHAN_IN1(digit_t, N[i], MC_IN_CH(ch_modulus, task_init, task_crt_result));
+        m = *CHAN_IN1(digit_t, product[i], RET_CH(ch_mod_exp));
+        mq = *CHAN_IN1(digit_t, mq[i], SELF_IN_CH(task_crt_result));
+
+        acc += (int32_t)m + 2 * (int32_t)n - (int32_t)mq;
+        x = acc & DIGIT_MASK;
+        acc = (acc - x) / (int32_t)DIGIT_BASE;
+        CHAN_OUT1(digit_t, X[i], x, CALL_CH(ch_mod_n));
+    }
+    x = acc;
+    CHAN_OUT1(digit_t, X[NUM_DIGITS], x, CALL_CH(ch_mod_n));
+
+    // Reduced by the division hypertask; in the Montgomery mode, the shift
+    // by b^k cancels the R^-1 of the product
+    unsigned len = NUM_DIGITS + 1, first = 0;
+#if CONFIG_REDUCE == REDUCE_MONTGOMERY
+    unsigned shift = NUM_DIGITS;
+#else
+    unsigned shift = 0;
+#endif
+    CHAN_OUT1(unsigned, len, len, CALL_CH(ch_mod_n));
+    CHAN_OUT1(unsigned, shift, shift, CALL_CH(ch_mod_n));
+    CHAN_OUT1(unsigned, digit, first, CALL_CH(ch_mod_n));
+
+    const task_t *next_task = TASK_REF(task_crt_qinv);
+    CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_mod_n));
+    TRANSITION_TO(task_mod_n);
+}
+
+// h = (m_p - m_q) * qinv mod p, by the mult-mod hypertask
+void task_crt_qinv()
+{
+    int i;
+    digit_t r, qinv[MAX_DIGITS];
+
+    LOG_INFO("crt qinv\r\n");
+
+    unpack_digits(qinv, privkey.qinv, NUM_DIGITS);
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        r = *CHAN_IN1(digit_t, product[i], RET_CH(ch_mod_n));
+        CHAN_OUT1(digit_t, A[i], r, CALL_CH(ch_mult_mod));
+        CHAN_OUT1(digit_t, B[i], qinv[i], CALL_CH(ch_mult_mod));
+    }
+    const task_t *next_task = TASK_REF(task_crt_garner);
+    CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_mult_mod));
+    TRANSITION_TO(task_mult_mod);
+}
+
+// Recombination: m = m_q + h * q (full width), and the payload bytes of the
+// padded block go to the decrypted message
+void task_crt_garner()
+{
+    int i, j;
+    unsigned block_offset, decrypted_len;
+    digit_t h[MAX_DIGITS], q[MAX_DIGITS], m[MAX_DIGITS * 2];
+    ddigit_t c, dp;
+
+    block_offset = *CHAN_IN1(unsigned, block_offset,
+                             MC_IN_CH(ch_crt_block, task_crt_block, task_crt_garner));
+
+    LOG_INFO("crt garner: offset=%u\r\n", block_offset);
+
+    unpack_digits(q, privkey.q, NUM_DIGITS);
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        h[i] = *CHAN_IN1(digit_t, product[i], RET_CH(ch_mult_mod));
+        m[i] = *CHAN_IN1(digit_t, mq[i], CH(task_crt_result, task_crt_garner));
+        m[NUM_DIGITS + i] = 0;
+    }
+
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        c = 0;
+        for (j = 0; j < NUM_DIGITS; ++j) {
+            dp = MULT_DIGITS(h[i], q[j]) + m[i + j] + c;
+            m[i + j] = dp & DIGIT_MASK;
+            c = dp >> DIGIT_BITS;
+        }
+        for (j = i + NUM_DIGITS; c && j < NUM_DIGITS * 2; ++j) {
+            dp = m[j] + c;
+            m[j] = dp & DIGIT_MASK;
+            c = dp >> DIGIT_BITS;
+        }
+    }
+
+    decrypted_len = block_offset / KEY_SIZE_BYTES * BLOCK_PAYLOAD_BYTES;
+    for (i = 0; i < BLOCK_PAYLOAD_BYTES; ++i) { // LSB first
+        uint8_t b = m[i / DIGIT_BYTES] >> (8 * (i % DIGIT_BYTES));
+        CHAN_OUT1(uint8_t, decrypted[decrypted_len + i], b,
+                  CH(task_crt_garner, task_print_decrypted));
+    }
+
+#ifdef SHOW_COARSE_PROGRESS_ON_LED
+    GPIO(PORT_LED_1, OUT) |= BIT(PIN_LED_1);
+#endif
+
+    block_offset += KEY_SIZE_BYTES;
+    CHAN_OUT1(unsigned, block_offset, block_offset, CH(task_crt_garner, task_crt_block));
+    TRANSITION_TO(task_crt_block);
+}
+
+#define DECRYPTED(i) (*CHAN_IN1(uint8_t, decrypted[i], CH(task_crt_garner, task_print_decrypted)))
+
+#if CONFIG_COMPRESS
+// Last bytes of the decompressed message, for copying the matches
+static __nv uint8_t lz_window[CONFIG_COMPRESS_WINDOW];
+
+// Decompressed message (see task_compress for the format), up to its original
+// length. This is the end of the program, so it need not be resumable.
+static void print_decompressed(unsigned decrypted_len)
+{
+    unsigned i, n, len, count, dist;
+    uint8_t c;
+
+    n = DECRYPTED(0) | (DECRYPTED(1) << 8);
+    LOG_INFO("print decrypted: decompressed len=%u\r\n", n);
+
+    len = 0;
+    for (i = LZ_HEADER_BYTES; len < n && i < decrypted_len; ) {
+        c = DECRYPTED(i++);
+        if (c & 0x80) {
+            count = ((c >> 3) & 0xf) + LZ_MIN_MATCH;
+            dist = (((c & 0x7) << 8) | DECRYPTED(i)) + 1;
+            i++;
+        } else {
+            count = c + 1;
+            dist = 0;
+        }
+
+        for (; count > 0 && len < n; --count, ++len) {
+            if (dist)
+                c = lz_window[(len - dist) & (CONFIG_COMPRESS_WINDOW - 1)];
+            else
+                c = DECRYPTED(i++);
+            lz_window[len & (CONFIG_COMPRESS_WINDOW - 1)] = c;
+            printf("%c", c);
+        }
+    }
+}
+#endif
+
+void task_print_decrypted()
+{
+    unsigned decrypted_len;
+
+    decrypted_len = *CHAN_IN1(unsigned, decrypted_len, CH(task_crt_block, task_print_decrypted));
+
+#if CONFIG_COMPRESS
+    printf("Decrypted:\r\n");
+    print_decompressed(decrypted_len);
+    printf("\r\n");
+#else
+    int i;
+    uint8_t c;
+
+    // The last block is padded with 0xFF
+    while (decrypted_len > 0 && DECRYPTED(decrypted_len - 1) == 0xFF)
+        --decrypted_len;
+
+    LOG_INFO("print decrypted: len=%u\r\n", decrypted_len);
+
+    printf("Decrypted:\r\n");
+    for (i = 0; i < decrypted_len; ++i) {
+        c = DECRYPTED(i);
+        printf("%c", c);
+    }
+    printf("\r\n");
+#endif
+#if CONFIG_BENCH
+    bench_report();
+#endif
+
+#ifdef SHOW_COARSE_PROGRESS_ON_LED
+    blink(1, BLINK_MESSAGE_DONE, LED2);
+#endif
+    while(1);
+    TRANSITION_TO(task_init);
+}
+#endif // CONFIG_DECRYPT
+
+// TODO: this task also looks like a proxy: is it avoidable?
+void task_mult_mod()
+{
+    int i;
+    digit_t a, b;
+
+    LOG_DEBUG("mult mod\r\n");
+
+#if CONFIG_REDUCE == REDUCE_MONTGOMERY && CONFIG_MONT_CIOS
+    // The fused kernel reads the operands straight from the call channel
+    i = 0;
+    CHAN_OUT1(unsigned, digit, i, CH(task_mult_mod, task_mont_mult));
+    TRANSITION_TO(task_mont_mult);
+#endif
+
+#if KARATSUBA
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        a = *CHAN_IN1(digit_t, A[i], CALL_CH(ch_mult_mod));
+        b = *CHAN_IN1(digit_t, B[i], CALL_CH(ch_mult_mod));
+
+        CHAN_OUT1(digit_t, X[i], a, CH(task_mult_mod, task_kara));
+        CHAN_OUT1(digit_t, Y[i], b, CH(task_mult_mod, task_kara));
+    }
+    unsigned root = 0;
+    CHAN_OUT1(unsigned, level, root, CH(task_mult_mod, task_kara));
+    CHAN_OUT1(unsigned, phase[0], root, CH(task_mult_mod, task_kara));
+    TRANSITION_TO(task_kara);
+#endif
+
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        a = *CHAN_IN1(digit_t, A[i], CALL_CH(ch_mult_mod));
+        b = *CHAN_IN1(digit_t, B[i], CALL_CH(ch_mult_mod));
+
+        LOG_TRACE("mult mod: i=%u a=%x b=%x\r\n", i, a, b);
+
+        CHAN_OUT1(digit_t, A[i], a, CH(task_mult_mod, task_mult));
+        CHAN_OUT1(digit_t, B[i], b, CH(task_mult_mod, task_mult));
+    }
+    unsigned tmp = 0; 
+    ddigit_t zero = 0;
+    bool square = false;
+    CHAN_OUT1(unsigned, digit, tmp, CH(task_mult_mod, task_mult));
+    CHAN_OUT1(ddigit_t, carry, zero, CH(task_mult_mod, task_mult));
+    CHAN_OUT1(bool, square, square, CH(task_mult_mod, task_mult));
+
+    TRANSITION_TO(task_mult);
+}
+
+// Modular squaring: A^2 mod N. The square is computed by task_mult in its
+// squaring mode and then goes through the same reduction as a product, so
+// the result is returned on the mult-mod return channel.
+void task_sqr_mod()
+{
+    int i;
+    digit_t a;
+
+    LOG_DEBUG("sqr mod\r\n");
+
+#if CONFIG_REDUCE == REDUCE_MONTGOMERY && CONFIG_MONT_CIOS
+    // The fused kernel reads the operand straight from the call channel
+    i = 0;
+    CHAN_OUT1(unsigned, digit, i, CH(task_sqr_mod, task_mont_sqr));
+    TRANSITION_TO(task_mont_sqr);
+#endif
+
+    // The reduction step returns to the caller of mult-mod
+    const task_t *next_task = *CHAN_IN1(task_t *, next_task, CALL_CH(ch_sqr_mod));
+    CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_mult_mod));
+
+#if KARATSUBA
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        a = *CHAN_IN1(digit_t, A[i], CALL_CH(ch_sqr_mod));
+
+        CHAN_OUT1(digit_t, X[i], a, CH(task_sqr_mod, task_kara));
+        CHAN_OUT1(digit_t, Y[i], a, CH(task_sqr_mod, task_kara));
+    }
+    unsigned root = 0;
+    CHAN_OUT1(unsigned, level, root, CH(task_sqr_mod, task_kara));
+    CHAN_OUT1(unsigned, phase[0], root, CH(task_sqr_mod, task_kara));
+    TRANSITION_TO(task_kara);
+#endif
+
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        a = *CHAN_IN1(digit_t, A[i], CALL_CH(ch_sqr_mod));
+
+        LOG_TRACE("sqr mod: i=%u a=%x\r\n", i, a);
+
+        CHAN_OUT1(digit_t, A[i], a, CH(task_sqr_mod, task_mult));
+    }
+    unsigned tmp = 0;
+    ddigit_t zero = 0;
+    bool square = true;
+    CHAN_OUT1(unsigned, digit, tmp, CH(task_sqr_mod, task_mult));
+    CHAN_OUT1(ddigit_t, carry, zero, CH(task_sqr_mod, task_mult));
+    CHAN_OUT1(bool, square, square, CH(task_sqr_mod, task_mult));
+
+    TRANSITION_TO(task_mult);
+}
+
+// Add a double digit to the three-digit column accumulator
+static inline void comba_add(digit_t *acc, ddigit_t dp)
+{
+    ddigit_t t;
+
+    t = (ddigit_t)acc[0] + (dp & DIGIT_MASK);
+    acc[0] = t & DIGIT_MASK;
+    t = (ddigit_t)acc[1] + (dp >> DIGIT_BITS) + (t >> DIGIT_BITS);
+    acc[1] = t & DIGIT_MASK;
+    acc[2] += t >> DIGIT_BITS;
+}
+
+// Computes the product columns [digit, digit + CONFIG_MULT_COLUMNS) column by
+// column (Comba), keeping the column sum in a three-digit accumulator whose
+// upper two digits carry into the next column.
+void task_mult()
+{
+    int i;
+    int digit, last;
+    unsigned len;
+    ddigit_t carry;
+    digit_t acc[3];
+#if !KARATSUBA
+    int lo, hi;
+    digit_t a[MAX_DIGITS], b[MAX_DIGITS];
+    ddigit_t dp;
+    bool square;
+#endif
+
+#ifdef SHOW_PROGRESS_ON_LED
+    blink(1, BLINK_DURATION_TASK / 4, LED1);
+#endif
+
+#if KARATSUBA
+    digit = *CHAN_IN2(int, digit, CH(task_kara, task_mult), SELF_IN_CH(task_mult));
+    carry = *CHAN_IN2(ddigit_t, carry, CH(task_kara, task_mult), SELF_IN_CH(task_mult));
+
+    LOG_DEBUG("mult: kara: digit=%u carry=%x\r\n", digit, carry);
+#else // !KARATSUBA
+    digit = *CHAN_IN3(int, digit, CH(task_mult_mod, task_mult), CH(task_sqr_mod, task_mult),
+                      SELF_IN_CH(task_mult));
+    carry = *CHAN_IN3(ddigit_t, carry, CH(task_mult_mod, task_mult), CH(task_sqr_mod, task_mult),
+                      SELF_IN_CH(task_mult));
+    square = *CHAN_IN2(bool, square, CH(task_mult_mod, task_mult), CH(task_sqr_mod, task_mult));
+
+    LOG_DEBUG("mult: digit=%u carry=%x square=%u\r\n", digit, carry, square);
+#endif // !KARATSUBA
+
+    // Number of digits up to the most significant non-zero one so far
+    len = digit ? *CHAN_IN1(unsigned, len, SELF_IN_CH(task_mult)) : 0;
+
+    last = digit + CONFIG_MULT_COLUMNS;
+    if (last > NUM_DIGITS * 2)
+        last = NUM_DIGITS * 2;
+
+#if !KARATSUBA
+    // Read the operand digits that contribute to these columns once
+    lo = (digit < NUM_DIGITS) ? 0 : digit - NUM_DIGITS + 1;
+    hi = (last <= NUM_DIGITS) ? last - 1 : NUM_DIGITS - 1;
+    for (i = lo; i <= hi; ++i) {
+        if (square) {
+            a[i] = *CHAN_IN1(digit_t, A[i], CH(task_sqr_mod, task_mult));
+        } else {
+            a[i] = *CHAN_IN1(digit_t, A[i], CH(task_mult_mod, task_mult));
+            b[i] = *CHAN_IN1(digit_t, B[i], CH(task_mult_mod, task_mult));
+        }
+    }
+#endif
+
+    acc[0] = carry & DIGIT_MASK;
+    acc[1] = carry >> DIGIT_BITS;
+    acc[2] = 0;
+
+    for (; digit < last; ++digit) {
+#if KARATSUBA
+        // Column of Z0 + mid * b^h + Z2 * b^k (h = k/2)
+        if (digit < NUM_DIGITS)
+            comba_add(acc, *CHAN_IN1(digit_t, Z0[digit], CH(task_kara, task_mult)));
+        else
+            comba_add(acc, *CHAN_IN1(digit_t, Z2[digit - NUM_DIGITS], CH(task_kara, task_mult)));
+        if (digit >= NUM_DIGITS / 2 && digit <= NUM_DIGITS / 2 + NUM_DIGITS)
+            comba_add(acc, *CHAN_IN1(digit_t, mid[digit - NUM_DIGITS / 2], CH(task_kara, task_mult)));
+#else // !KARATSUBA
+        lo = (digit < NUM_DIGITS) ? 0 : digit - NUM_DIGITS + 1;
+        if (square) {
+            // Column of A^2: the products A[i] * A[digit - i] for i < digit - i
+            // each appear twice, so they are computed once and added twice.
+            // The middle product (even columns) appears once.
+            for (i = lo; 2 * i <= digit; ++i) {
+                dp = MULT_DIGITS(a[i], a[digit - i]);
+                comba_add(acc, dp);
+                if (2 * i < digit)
+                    comba_add(acc, dp);
+            }
+        } else {
+            for (i = lo; i <= digit && i < NUM_DIGITS; ++i)
+                comba_add(acc, MULT_DIGITS(a[digit - i], b[i]));
+        }
+#endif // !KARATSUBA
+
+        LOG_TRACE("mult: digit=%u p=%x\r\n", digit, acc[0]);
+
+        if (acc[0])
+            len = digit + 1;
+
+        CHAN_OUT1(digit_t, product[digit], acc[0], MC_OUT_CH(ch_product, task_mult,
+                 task_reduce_digits,
+                 task_reduce_normalizable, task_reduce_normalize));
+
+        CHAN_OUT1(digit_t, product[digit], acc[0], CALL_CH(ch_print_product));
+
+        acc[0] = acc[1];
+        acc[1] = acc[2];
+        acc[2] = 0;
+    }
+
+    carry = acc[0] | ((ddigit_t)acc[1] << DIGIT_BITS);
+
+    if (digit < NUM_DIGITS * 2) {
+        CHAN_OUT1(ddigit_t, carry, carry, SELF_OUT_CH(task_mult));
+        CHAN_OUT1(int, digit, digit, SELF_OUT_CH(task_mult));
+        CHAN_OUT1(unsigned, len, len, SELF_OUT_CH(task_mult));
+        TRANSITION_TO(task_mult);
+    } else {
+        CHAN_OUT1(unsigned, len, len, MC_OUT_CH(ch_product, task_mult,
+                 task_reduce_digits,
+                 task_reduce_normalizable, task_reduce_normalize));
+        CHAN_OUT1(unsigned, len, len, CALL_CH(ch_print_product));
+
+#if CONFIG_REDUCE == REDUCE_MONTGOMERY
+        unsigned first = 0;
+        ddigit_t zero = 0;
+        CHAN_OUT1(unsigned, digit, first, CH(task_mult, task_mont_reduce));
+        CHAN_OUT1(ddigit_t, carry, zero, CH(task_mult, task_mont_reduce));
+        const task_t *next_task = TASK_REF(task_mont_reduce);
+#elif CONFIG_REDUCE == REDUCE_BARRETT
+        unsigned first = NUM_DIGITS - 1;
+        ddigit_t zero = 0;
+        CHAN_OUT1(unsigned, digit, first, CH(task_mult, task_barrett_quotient));
+        CHAN_OUT1(ddigit_t, carry, zero, CH(task_mult, task_barrett_quotient));
+        const task_t *next_task = TASK_REF(task_barrett_quotient);
+#else
+        const task_t *next_task = TASK_REF(task_reduce_digits);  
+#endif
+        CHAN_OUT1(task_t *, next_task, next_task  , CALL_CH(ch_print_product));
+        TRANSITION_TO(task_print_product);
+    }
+}
 
-        LOG("mult mod: i=%u a=%x b=%x\r\n", i, a, b);
+#if KARATSUBA
+// Operand digits of the node at the given level: the root operands come from
+// the caller (mult-mod or sqr-mod), the others from the node frames.
+#define KARA_OPERAND(f, level, i) ((level) ? \
+    *CHAN_IN1(digit_t, f[i], SELF_IN_CH(task_kara)) : \
+    *CHAN_IN2(digit_t, f[i], CH(task_mult_mod, task_kara), CH(task_sqr_mod, task_kara)))
 
-        CHAN_OUT1(digit_t, A[i], a, CH(task_mult_mod, task_mult));
-        CHAN_OUT1(digit_t, B[i], b, CH(task_mult_mod, task_mult));
+// Hand the product r (2m digits) of the node at the given level to its parent
+static void kara_return(unsigned level, const digit_t *r)
+{
+    unsigned i;
+    unsigned parent = level - 1;
+    unsigned m = NUM_DIGITS >> level;
+    unsigned off = 2 * NUM_DIGITS - 4 * m; // frame of the parent
+    unsigned phase = *CHAN_IN3(unsigned, phase[parent], CH(task_mult_mod, task_kara),
+                               CH(task_sqr_mod, task_kara), SELF_IN_CH(task_kara));
+
+    LOG_DEBUG("kara: return: level=%u phase=%u\r\n", level, phase);
+
+    // The parent advanced its phase before descending
+    for (i = 0; i < 2 * m; ++i) {
+        switch (phase) {
+            case 1: CHAN_OUT1(digit_t, Z0[off + i], r[i], SELF_OUT_CH(task_kara)); break;
+            case 2: CHAN_OUT1(digit_t, Z2[off + i], r[i], SELF_OUT_CH(task_kara)); break;
+            case 3: CHAN_OUT1(digit_t, Z1[off + i], r[i], SELF_OUT_CH(task_kara)); break;
+        }
     }
-    unsigned tmp = 0; 
-    CHAN_OUT1(unsigned, digit, tmp, CH(task_mult_mod, task_mult));
-    CHAN_OUT1(unsigned, carry, tmp, CH(task_mult_mod, task_mult));
-
-    TRANSITION_TO(task_mult);
+    CHAN_OUT1(unsigned, level, parent, SELF_OUT_CH(task_kara));
 }
 
-void task_mult()
+// Recursive Karatsuba multiplication X * Y, one task per step of the
+// recursion. A node of level L with m digit operands, x = x1 b^h + x0 and
+// y = y1 b^h + y0 (h = m/2), goes through the phases:
+//   0: descend into x0 * y0                -> Z0
+//   1: descend into x1 * y1                -> Z2
+//   2: descend into |x0 - x1| * |y0 - y1|  -> Z1
+//   3: combine Z0 + (Z0 + Z2 -/+ Z1) b^h + Z2 b^m and return to the parent
+// Nodes of at most CONFIG_KARATSUBA_LEAF_DIGITS digits are multiplied by
+// schoolbook in a single step. The root hands its halves to task_mult, which
+// writes the product onto the same channel as the schoolbook multiplication.
+void task_kara()
 {
-    int i;
-    digit_t a, b, c;
-    digit_t dp, p, carry;
-    int digit;
+    int i, j;
+    unsigned level, phase, m, h, off, child;
+    digit_t x, y;
+    ddigit_t dp, c;
+    int32_t acc;
+    digit_t r[MAX_DIGITS];
 
 #ifdef SHOW_PROGRESS_ON_LED
     blink(1, BLINK_DURATION_TASK / 4, LED1);
 #endif
 
-    digit = *CHAN_IN2(int, digit, CH(task_mult_mod, task_mult), SELF_IN_CH(task_mult));
-    carry = *CHAN_IN2(digit_t, carry, CH(task_mult_mod, task_mult), SELF_IN_CH(task_mult));
+    level = *CHAN_IN3(unsigned, level, CH(task_mult_mod, task_kara), CH(task_sqr_mod, task_kara),
+                      SELF_IN_CH(task_kara));
+    phase = *CHAN_IN3(unsigned, phase[level], CH(task_mult_mod, task_kara),
+                      CH(task_sqr_mod, task_kara), SELF_IN_CH(task_kara));
+    m = NUM_DIGITS >> level;
+    h = m / 2;
+    off = 2 * NUM_DIGITS - 2 * m;
+    child = off + m;
 
-    LOG("mult: digit=%u carry=%x\r\n", digit, carry);
+    LOG_DEBUG("kara: level=%u phase=%u m=%u\r\n", level, phase, m);
 
-    p = carry;
-    c = 0;
-    for (i = 0; i < NUM_DIGITS; ++i) {
-        if (digit - i >= 0 && digit - i < NUM_DIGITS) {
-            a = *CHAN_IN1(digit_t, A[digit - i], CH(task_mult_mod, task_mult));
-            b = *CHAN_IN1(digit_t, B[i], CH(task_mult_mod, task_mult));
-            dp = a * b;
+    if (m <= CONFIG_KARATSUBA_LEAF_DIGITS) {
+        digit_t xs[CONFIG_KARATSUBA_LEAF_DIGITS], ys[CONFIG_KARATSUBA_LEAF_DIGITS];
 
-            c += dp >> DIGIT_BITS;
-            p += dp & DIGIT_MASK;
+        for (i = 0; i < m; ++i) {
+            xs[i] = *CHAN_IN1(digit_t, X[off + i], SELF_IN_CH(task_kara));
+            ys[i] = *CHAN_IN1(digit_t, Y[off + i], SELF_IN_CH(task_kara));
+            r[i] = 0;
+        }
+        for (i = 0; i < m; ++i) {
+            c = 0;
+            for (j = 0; j < m; ++j) {
+                dp = MULT_DIGITS(xs[i], ys[j]) + r[i + j] + c;
+                r[i + j] = dp & DIGIT_MASK;
+                c = dp >> DIGIT_BITS;
+            }
+            r[i + m] = c;
+        }
+
+        kara_return(level, r);
+        TRANSITION_TO(task_kara);
+    }
+
+    if (phase < 3) {
+        bool borrow_x = false, borrow_y = false;
+
+        if (phase == 2) {
+            // Compare the halves, from the most significant digit
+            for (i = h - 1; i >= 0; --i) {
+                x = KARA_OPERAND(X, level, off + i);
+                y = KARA_OPERAND(X, level, off + h + i);
+                if (x != y) {
+                    borrow_x = x < y;
+                    break;
+                }
+            }
+            for (i = h - 1; i >= 0; --i) {
+                x = KARA_OPERAND(Y, level, off + i);
+                y = KARA_OPERAND(Y, level, off + h + i);
+                if (x != y) {
+                    borrow_y = x < y;
+                    break;
+                }
+            }
+            bool neg = borrow_x != borrow_y;
+            CHAN_OUT1(bool, neg[level], neg, SELF_OUT_CH(task_kara));
+        }
 
-            LOG("mult: i=%u a=%x b=%x p=%x\r\n", i, a, b, p);
+        // Child operands: the low halves, the high halves, or the absolute
+        // differences of the halves
+        ddigit_t bx = 0, by = 0;
+        for (i = 0; i < h; ++i) {
+            digit_t lo, hi, d;
+
+            lo = KARA_OPERAND(X, level, off + i);
+            hi = KARA_OPERAND(X, level, off + h + i);
+            if (phase == 0) {
+                d = lo;
+            } else if (phase == 1) {
+                d = hi;
+            } else {
+                if (borrow_x) { // hi - lo
+                    dp = (ddigit_t)hi + DIGIT_BASE - lo - bx;
+                } else {
+                    dp = (ddigit_t)lo + DIGIT_BASE - hi - bx;
+                }
+                d = dp & DIGIT_MASK;
+                bx = (dp >> DIGIT_BITS) ? 0 : 1;
+            }
+            CHAN_OUT1(digit_t, X[child + i], d, SELF_OUT_CH(task_kara));
+
+            lo = KARA_OPERAND(Y, level, off + i);
+            hi = KARA_OPERAND(Y, level, off + h + i);
+            if (phase == 0) {
+                d = lo;
+            } else if (phase == 1) {
+                d = hi;
+            } else {
+                if (borrow_y) {
+                    dp = (ddigit_t)hi + DIGIT_BASE - lo - by;
+                } else {
+                    dp = (ddigit_t)lo + DIGIT_BASE - hi - by;
+                }
+                d = dp & DIGIT_MASK;
+                by = (dp >> DIGIT_BITS) ? 0 : 1;
+            }
+            CHAN_OUT1(digit_t, Y[child + i], d, SELF_OUT_CH(task_kara));
         }
+
+        unsigned next_phase = phase + 1;
+        unsigned first = 0;
+        unsigned next_level = level + 1;
+        CHAN_OUT1(unsigned, phase[level], next_phase, SELF_OUT_CH(task_kara));
+        CHAN_OUT1(unsigned, phase[next_level], first, SELF_OUT_CH(task_kara));
+        CHAN_OUT1(unsigned, level, next_level, SELF_OUT_CH(task_kara));
+        TRANSITION_TO(task_kara);
     }
 
-    c += p >> DIGIT_BITS;
-    p &= DIGIT_MASK;
+    // Combine: the middle term Z0 + Z2 -/+ Z1 is x0 y1 + x1 y0 >= 0
+    bool neg = *CHAN_IN1(bool, neg[level], SELF_IN_CH(task_kara));
+    digit_t z0, z1, z2;
+
+    if (level == 0) {
+        // The root sends the halves and the middle term (k+1 digits) to
+        // task_mult, which adds them up while producing the product digits
+        acc = 0;
+        for (i = 0; i < m; ++i) {
+            z0 = *CHAN_IN1(digit_t, Z0[off + i], SELF_IN_CH(task_kara));
+            z1 = *CHAN_IN1(digit_t, Z1[off + i], SELF_IN_CH(task_kara));
+            z2 = *CHAN_IN1(digit_t, Z2[off + i], SELF_IN_CH(task_kara));
+
+            acc += (int32_t)z0 + z2;
+            acc += neg ? (int32_t)z1 : -(int32_t)z1;
+            x = acc & DIGIT_MASK;
+            acc = (acc - x) / (int32_t)DIGIT_BASE;
+
+            CHAN_OUT1(digit_t, Z0[i], z0, CH(task_kara, task_mult));
+            CHAN_OUT1(digit_t, Z2[i], z2, CH(task_kara, task_mult));
+            CHAN_OUT1(digit_t, mid[i], x, CH(task_kara, task_mult));
+        }
+        x = acc;
+        CHAN_OUT1(digit_t, mid[m], x, CH(task_kara, task_mult));
 
-    LOG("mult: c=%x p=%x\r\n", c, p);
+        unsigned first = 0;
+        ddigit_t zero = 0;
+        CHAN_OUT1(unsigned, digit, first, CH(task_kara, task_mult));
+        CHAN_OUT1(ddigit_t, carry, zero, CH(task_kara, task_mult));
+        TRANSITION_TO(task_mult);
+    }
 
-    CHAN_OUT1(digit_t, product[digit], p, MC_OUT_CH(ch_product, task_mult,
-             task_reduce_digits,
-             task_reduce_n_divisor, task_reduce_normalizable, task_reduce_normalize));
+    acc = 0;
+    for (i = 0; i < 2 * m; ++i) {
+        if (i < m)
+            acc += *CHAN_IN1(digit_t, Z0[off + i], SELF_IN_CH(task_kara));
+        else
+            acc += *CHAN_IN1(digit_t, Z2[off + i - m], SELF_IN_CH(task_kara));
 
-    CHAN_OUT1(digit_t, product[digit], p, CALL_CH(ch_print_product));
+        if (i >= h && i < h + m) {
+            z0 = *CHAN_IN1(digit_t, Z0[off + i - h], SELF_IN_CH(task_kara));
+            z1 = *CHAN_IN1(digit_t, Z1[off + i - h], SELF_IN_CH(task_kara));
+            z2 = *CHAN_IN1(digit_t, Z2[off + i - h], SELF_IN_CH(task_kara));
 
-    digit++;
+            acc += (int32_t)z0 + z2;
+            acc += neg ? (int32_t)z1 : -(int32_t)z1;
+        }
 
-    if (digit < NUM_DIGITS * 2) {
-        CHAN_OUT1(digit_t, carry, c, SELF_OUT_CH(task_mult));
-        CHAN_OUT1(int, digit, digit, SELF_OUT_CH(task_mult));
-        TRANSITION_TO(task_mult);
-    } else {
-        const task_t *next_task = TASK_REF(task_reduce_digits);  
-        CHAN_OUT1(task_t *, next_task, next_task  , CALL_CH(ch_print_product));
-        TRANSITION_TO(task_print_product);
+        r[i] = acc & DIGIT_MASK;
+        acc = (acc - r[i]) / (int32_t)DIGIT_BASE;
     }
+
+    kara_return(level, r);
+    TRANSITION_TO(task_kara);
 }
+#endif // KARATSUBA
 
 void task_reduce_digits()
 {
     int d;
-    digit_t m;
+    unsigned len;
 
-    LOG("reduce: digits\r\n");
+    LOG_DEBUG("reduce: digits\r\n");
 
     // Start reduction loop at most significant non-zero digit
-    d = 2 * NUM_DIGITS;
-    do {
-        d--;
-        m = *CHAN_IN1(digit_t, product[d], MC_IN_CH(ch_product, task_mult, task_reduce_digits));
-        LOG("reduce digits: p[%u]=%x\r\n", d, m);
-    } while (m == 0 && d > 0);
+    len = *CHAN_IN1(unsigned, len, MC_IN_CH(ch_product, task_mult, task_reduce_digits));
 
-    if (m == 0) {
-        LOG("reduce: digits: all digits of message are zero\r\n");
+    if (len == 0) {
+        LOG_DEBUG("reduce: digits: all digits of message are zero\r\n");
         TRANSITION_TO(task_init);
     }
-    LOG("reduce: digits: d = %u\r\n", d);
+    d = len - 1;
+    LOG_DEBUG("reduce: digits: d = %u\r\n", d);
 
     CHAN_OUT1(int, digit, d, MC_OUT_CH(ch_digit, task_reduce_digits,
                                  task_reduce_normalizable, task_reduce_normalize,
@@ -767,10 +4087,11 @@ void task_reduce_digits()
 void task_reduce_normalizable()
 {
     int i;
-    unsigned m, n, d, offset;
+    digit_t m, n;
+    unsigned d, offset;
     bool normalizable = true;
 
-    LOG("reduce: normalizable\r\n");
+    LOG_DEBUG("reduce: normalizable\r\n");
 
     // Variables:
     //   m: message
@@ -801,17 +4122,17 @@ void task_reduce_normalizable()
     d = *CHAN_IN1(unsigned, digit, MC_IN_CH(ch_digit, task_reduce_digits, task_reduce_noramlizable));
 
     offset = d + 1 - NUM_DIGITS; // TODO: can this go below zero
-    LOG("reduce: normalizable: d=%u offset=%u\r\n", d, offset);
+    LOG_DEBUG("reduce: normalizable: d=%u offset=%u\r\n", d, offset);
 
     CHAN_OUT1(unsigned, offset, offset, CH(task_reduce_normalizable, task_reduce_normalize));
 
     for (i = d; i >= 0; --i) {
-        m = *CHAN_IN1(unsigned, product[i],
+        m = *CHAN_IN1(digit_t, product[i],
                       MC_IN_CH(ch_product, task_mult, task_reduce_normalizable));
-        n = *CHAN_IN1(unsigned, N[i - offset], MC_IN_CH(ch_modulus, task_init,
+        n = *CHAN_IN1(digit_t, N[i - offset], MC_IN_CH(ch_modulus, task_init,
                                               task_reduce_normalizable));
 
-        LOG("normalizable: m[%u]=%x n[%u]=%x\r\n", i, m, i - offset, n);
+        LOG_TRACE("normalizable: m[%u]=%x n[%u]=%x\r\n", i, m, i - offset, n);
 
         if (m > n) {
             break;
@@ -822,26 +4143,26 @@ void task_reduce_normalizable()
     }
 
     if (!normalizable && d == NUM_DIGITS - 1) {
-        LOG("reduce: normalizable: reduction done: message < modulus\r\n");
+        LOG_DEBUG("reduce: normalizable: reduction done: message < modulus\r\n");
 
         // TODO: is this copy avoidable? a 'mult mod done' task doesn't help
         // because we need to ship the data to it.
         for (i = 0; i < NUM_DIGITS; ++i) {
-            m = *CHAN_IN1(unsigned, product[i],
+            m = *CHAN_IN1(digit_t, product[i],
                           MC_IN_CH(ch_product, task_mult, task_reduce_normalizable));
-            CHAN_OUT1(unsigned, product[i], m, RET_CH(ch_mult_mod));
+            CHAN_OUT1(digit_t, product[i], m, RET_CH(ch_mult_mod));
         }
 
         const task_t *next_task = *CHAN_IN1(task_t *,next_task, CALL_CH(ch_mult_mod));
         transition_to(next_task);
     }
 
-    LOG("normalizable: %u\r\n", normalizable);
+    LOG_DEBUG("normalizable: %u\r\n", normalizable);
 
     if (normalizable) {
         TRANSITION_TO(task_reduce_normalize);
     } else {
-        TRANSITION_TO(task_reduce_n_divisor);
+        TRANSITION_TO(task_reduce_quotient);
     }
 }
 
@@ -849,11 +4170,12 @@ void task_reduce_normalizable()
 void task_reduce_normalize()
 {
     int i;
-    digit_t m, n, d, s;
-    unsigned borrow, offset;
+    digit_t m, n, d;
+    ddigit_t s;
+    unsigned borrow, offset, len;
     const task_t *next_task;
 
-    LOG("normalize\r\n");
+    LOG_DEBUG("normalize\r\n");
 
     offset = *CHAN_IN1(unsigned, offset, CH(task_reduce_normalizable, task_reduce_normalize));
 
@@ -871,34 +4193,33 @@ void task_reduce_normalize()
 
         s = n + borrow;
         if (m < s) {
-            m += 1 << DIGIT_BITS;
+            d = m + DIGIT_BASE - s;
             borrow = 1;
         } else {
+            d = m - s;
             borrow = 0;
         }
-        d = m - s;
 
-        LOG("normalize: m[%u]=%x n[%u]=%x b=%u d=%x\r\n",
+        LOG_TRACE("normalize: m[%u]=%x n[%u]=%x b=%u d=%x\r\n",
                 i + offset, m, i, n, borrow, d);
 
         CHAN_OUT1(digit_t, product[i + offset], d,
                  MC_OUT_CH(ch_normalized_product, task_reduce_normalize,
-                           task_reduce_quotient, task_reduce_compare,
-                           task_reduce_add, task_reduce_subtract));
+                           task_reduce_quotient, task_reduce_subtract));
 
         CHAN_OUT1(digit_t, product[i + offset], d, CALL_CH(ch_print_product));
     }
 
-    // To call the print task, we need to proxy the values we don't touch
-    for (i = offset + NUM_DIGITS; i < NUM_DIGITS * 2; ++i) {
-        digit_t tmp = 0; 
-        CHAN_OUT1(digit_t, product[i], tmp, CALL_CH(ch_print_product));
-    }
+    len = offset + NUM_DIGITS;
+    CHAN_OUT1(unsigned, len, len,
+             MC_OUT_CH(ch_normalized_product, task_reduce_normalize,
+                       task_reduce_quotient, task_reduce_subtract));
+    CHAN_OUT1(unsigned, len, len, CALL_CH(ch_print_product));
 
     if (offset > 0) { // l-1 > k-1 (loop bounds), where offset=l-k, where l=|m|,k=|n|
-        next_task = TASK_REF(task_reduce_n_divisor);
+        next_task = TASK_REF(task_reduce_quotient);
     } else {
-        LOG("reduce: normalize: reduction done: no digits to reduce\r\n");
+        LOG_DEBUG("reduce: normalize: reduction done: no digits to reduce\r\n");
         // TODO: is this copy avoidable?
         for (i = 0; i < NUM_DIGITS; ++i) {
             m = *CHAN_IN1(digit_t, product[i],
@@ -912,37 +4233,42 @@ void task_reduce_normalize()
     TRANSITION_TO(task_print_product);
 }
 
-void task_reduce_n_divisor()
+// Quotient digit floor((u2 u1 u0) / n_div) for a normalized two-digit divisor
+// n_div with precomputed reciprocal v = floor((b^3 - 1) / n_div) - b and
+// (u2 u1) < n_div (Moller and Granlund, "Improved division by invariant
+// integers", Algorithm 5). Only products of two digits are needed, and the
+// two corrections are taken rarely.
+static digit_t div_3by2(digit_t u2, digit_t u1, digit_t u0, ddigit_t n_div, digit_t v)
 {
-    digit_t n[2]; // [1]=N[msd], [0]=N[msd-1]
-    digit_t n_div;
-
-#ifdef SHOW_PROGRESS_ON_LED
-    blink(1, SEC_TO_CYCLES, LED2);
-#endif
-
-    LOG("reduce: n divisor\r\n");
-
-    n[1]  = *CHAN_IN1(digit_t, N[NUM_DIGITS - 1],
-                      MC_IN_CH(ch_modulus, task_init, task_reduce_n_divisor));
-    n[0] = *CHAN_IN1(digit_t,N[NUM_DIGITS - 2], MC_IN_CH(ch_modulus, task_init, task_n_divisor));
-
-    // Divisor, derived from modulus, for refining quotient guess into exact value
-    n_div = ((n[1]<< DIGIT_BITS) + n[0]);
-
-    LOG("reduce: n divisor: n[1]=%x n[0]=%x n_div=%x\r\n", n[1], n[0], n_div);
-
-    CHAN_OUT1(digit_t, n_div, n_div, CH(task_reduce_n_divisor, task_reduce_quotient));
+    digit_t n1 = n_div >> DIGIT_BITS;
+    digit_t n0 = n_div & DIGIT_MASK;
+    digit_t q1, q0, r1;
+    ddigit_t q, r;
+
+    q = (ddigit_t)(MULT_DIGITS(v, u2) + (((ddigit_t)u2 << DIGIT_BITS) | u1));
+    q1 = q >> DIGIT_BITS;
+    q0 = q & DIGIT_MASK;
+
+    r1 = (u1 - MULT_DIGITS(q1, n1)) & DIGIT_MASK;
+    r = (ddigit_t)((((ddigit_t)r1 << DIGIT_BITS) | u0) - MULT_DIGITS(q1, n0) - n_div);
+    q1 = (q1 + 1) & DIGIT_MASK;
+
+    if ((r >> DIGIT_BITS) >= q0) {
+        q1 = (q1 - 1) & DIGIT_MASK;
+        r = (ddigit_t)(r + n_div);
+    }
+    if (r >= n_div)
+        q1++;
 
-    TRANSITION_TO(task_reduce_quotient);
+    return q1;
 }
 
 void task_reduce_quotient()
 {
     unsigned d;
     digit_t m[3]; // [2]=m[d], [1]=m[d-1], [0]=m[d-2]
-    digit_t m_n, n_div, q;
-    uint32_t qn, n_q; // must hold at least 3 digits
+    digit_t q, n_recip;
+    ddigit_t n_div, m_hi;
 
 #ifdef SHOW_PROGRESS_ON_LED
     blink(1, BLINK_DURATION_TASK, LED2);
@@ -951,7 +4277,7 @@ void task_reduce_quotient()
     d = *CHAN_IN2(unsigned, digit, MC_IN_CH(ch_digit, task_reduce_digits, task_reduce_quotient),
                          SELF_IN_CH(task_reduce_quotient));
 
-    LOG("reduce: quotient: d=%x\r\n", d);
+    LOG_DEBUG("reduce: quotient: d=%x\r\n", d);
 
     m[2] = *CHAN_IN3(digit_t, product[d],
                      MC_IN_CH(ch_product, task_mult, task_reduce_quotient),
@@ -971,325 +4297,525 @@ void task_reduce_quotient()
                               task_reduce_quotient));
     // NOTE: we asserted that NUM_DIGITS >= 2, so p[d-2] is safe
 
-    m_n = *CHAN_IN1(digit_t, N[NUM_DIGITS - 1],
-                    MC_IN_CH(ch_modulus, task_init, task_reduce_quotient));
+    n_div = *CHAN_IN1(ddigit_t, n_div, CH(task_init, task_reduce_quotient));
+    n_recip = *CHAN_IN1(digit_t, n_recip, CH(task_init, task_reduce_quotient));
 
-    LOG("reduce: quotient: m_n=%x m[d]=%x\r\n", m_n, m[2]);
+    LOG_DEBUG("reduce: quotient: m[d]=%x m[d-1]=%x m[d-2]=%x n_div=%x\r\n",
+        m[2], m[1], m[0], n_div);
 
-    // Choose an initial guess for quotient
-    if (m[2] == m_n) {
-        q = (1 << DIGIT_BITS) - 1;
+    // The remainder is below N * b^(d - NUM_DIGITS + 1), so its top two
+    // digits are at most those of N: if equal, the quotient digit saturates.
+    m_hi = ((ddigit_t)m[2] << DIGIT_BITS) | m[1];
+    if (m_hi >= n_div) {
+        q = DIGIT_MASK;
     } else {
-        q = ((m[2] << DIGIT_BITS) + m[1]) / m_n;
+        q = div_3by2(m[2], m[1], m[0], n_div, n_recip);
     }
 
-    LOG("reduce: quotient: q0=%x\r\n", q);
-
-    // Refine quotient guess
-
-    // NOTE: An alternative to composing the digits into one variable, is to
-    // have a loop that does the comparison digit by digit to implement the
-    // condition of the while loop below.
-    n_q = ((uint32_t)m[2] << (2 * DIGIT_BITS)) + (m[1] << DIGIT_BITS) + m[0];
-
-    LOG("reduce: quotient: m[d]=%x m[d-1]=%x m[d-2]=%x n_q=%x%x\r\n",
-           m[2], m[1], m[0], (uint16_t)((n_q >> 16) & 0xffff), (uint16_t)(n_q & 0xffff));
-
-    n_div = *CHAN_IN1(digit_t, n_div, CH(task_reduce_n_divisor, task_reduce_quotient));
-
-    LOG("reduce: quotient: n_div=%x q0=%x\r\n", n_div, q);
-
-    q++;
-    do {
-        q--;
-        qn = mult16(n_div, q);
-        LOG("reduce: quotient: q=%x qn=%x%x\r\n", q,
-              (uint16_t)((qn >> 16) & 0xffff), (uint16_t)(qn & 0xffff));
-    } while (qn > n_q);
-
-    // This is still not the final quotient, it may be off by one,
-    // which we determine and fix in the 'compare' and 'add' steps.
-    LOG("reduce: quotient: q=%x\r\n", q);
-
-    CHAN_OUT1(digit_t, quotient, q, CH(task_reduce_quotient, task_reduce_multiply));
+    // Since only the top two digits of N were taken into account, this
+    // quotient digit may still be one too large, which the subtraction
+    // detects and fixes in the same pass.
+    LOG_DEBUG("reduce: quotient: q=%x\r\n", q);
 
-    CHAN_OUT1(unsigned, digit, d, MC_OUT_CH(ch_reduce_digit, task_reduce_quotient,
-                                 task_reduce_multiply, task_reduce_add,
-                                 task_reduce_subtract));
+    CHAN_OUT1(digit_t, quotient, q, CH(task_reduce_quotient, task_reduce_subtract));
+    CHAN_OUT1(unsigned, digit, d, CH(task_reduce_quotient, task_reduce_subtract));
 
     d--;
     CHAN_OUT1(unsigned, digit, d, SELF_OUT_CH(task_reduce_quotient));
 
-    TRANSITION_TO(task_reduce_multiply);
+    TRANSITION_TO(task_reduce_subtract);
 }
 
-// NOTE: this is multiplication by one digit, hence not re-using mult task
-void task_reduce_multiply()
+// Subtract q * N * b^(d - NUM_DIGITS) from the remainder, multiplying N by
+// the quotient digit on the fly. If the difference turns out negative, the
+// quotient digit was one too large, and N * b^(d - NUM_DIGITS) is added back
+// before any of the digits are output.
+//
+// The remainder left by the step for digit d is below N * b^(d - NUM_DIGITS),
+// hence below b^d, so only the digits under d are output.
+void task_reduce_subtract()
 {
     int i;
-    digit_t m, q, n;
-    unsigned c, d, offset;
+    digit_t m, n, q, r;
+    digit_t t[MAX_DIGITS]; // digits [offset, d) of the difference
+    ddigit_t c, s;
+    unsigned d, borrow, offset, len;
 
 #ifdef SHOW_PROGRESS_ON_LED
     blink(1, BLINK_DURATION_TASK, LED2);
 #endif
 
-    d = *CHAN_IN1(unsigned, digit, MC_IN_CH(ch_reduce_digit,
-                                  task_reduce_quotient, task_reduce_multiply));
-    q = *CHAN_IN1(digit_t, quotient, CH(task_reduce_quotient, task_reduce_multiply));
-
-    LOG("reduce: multiply: d=%x q=%x\r\n", d, q);
+    d = *CHAN_IN1(unsigned, digit, CH(task_reduce_quotient, task_reduce_subtract));
+    q = *CHAN_IN1(digit_t, quotient, CH(task_reduce_quotient, task_reduce_subtract));
 
-    // As part of this task, we also perform the left-shifting of the q*m
-    // product by radix^(digit-NUM_DIGITS), where NUM_DIGITS is the number
-    // of digits in the modulus. We implement this by fetching the digits
-    // of number being reduced at that offset.
+    // The qn product is shifted by this offset, no need to subtract the zeros
     offset = d - NUM_DIGITS;
-    LOG("reduce: multiply: offset=%u\r\n", offset);
 
-    // For calling the print task we need to proxy to it values that
-    // we do not modify
-    for (i = 0; i < offset; ++i) {
-        digit_t tmp = 0; 
-        CHAN_OUT1(digit_t, product[i], tmp, CALL_CH(ch_print_product));
-    }
+    LOG_DEBUG("reduce: subtract: d=%u q=%x offset=%u\r\n", d, q, offset);
 
-    // TODO: could convert the loop into a self-edge
+    // TODO: could transform this loop into a self-edge
     c = 0;
-    for (i = offset; i < 2 * NUM_DIGITS; ++i) {
+    borrow = 0;
+    for (i = offset; i <= d; ++i) {
+        m = *CHAN_IN3(digit_t, product[i],
+                      MC_IN_CH(ch_product, task_mult, task_reduce_subtract),
+                      MC_IN_CH(ch_normalized_product, task_reduce_normalize, task_reduce_subtract),
+                      SELF_IN_CH(task_reduce_subtract));
 
-        // This condition creates the left-shifted zeros.
-        // TODO: consider adding number of digits to go along with the 'product' field,
-        // then we would not have to zero out the MSDs
-        m = c;
-        if (i < offset + NUM_DIGITS) {
+        // Next digit of q * N (the carry out of the last digit of N at the top)
+        s = c;
+        if (i < d) {
             n = *CHAN_IN1(digit_t, N[i - offset],
-                          MC_IN_CH(ch_modulus, task_init, task_reduce_multiply));
-            m += q * n;
+                          MC_IN_CH(ch_modulus, task_init, task_reduce_subtract));
+            s += MULT_DIGITS(q, n);
+        }
+        c = s >> DIGIT_BITS;
+
+        s = (s & DIGIT_MASK) + borrow;
+        if (m < s) {
+            r = m + DIGIT_BASE - s;
+            borrow = 1;
+        } else {
+            r = m - s;
+            borrow = 0;
+        }
+
+        LOG_TRACE("reduce: subtract: m[%u]=%x qn[%u]=%x b=%u r=%x\r\n",
+               i, m, i, s, borrow, r);
+
+        if (i < d)
+            t[i - offset] = r;
+    }
+
+    if (borrow) {
+        LOG_DEBUG("reduce: subtract: add back\r\n");
+
+        c = 0;
+        for (i = 0; i < NUM_DIGITS; ++i) {
+            n = *CHAN_IN1(digit_t, N[i], MC_IN_CH(ch_modulus, task_init, task_reduce_subtract));
+            s = c + t[i] + n;
+            c = s >> DIGIT_BITS;
+            t[i] = s & DIGIT_MASK;
+        }
+    }
+
+    for (i = 0; i < d; ++i) {
+        if (i >= offset) {
+            r = t[i - offset];
+
+            CHAN_OUT1(digit_t, product[i], r, MC_OUT_CH(ch_reduce_subtract_product, task_reduce_subtract,
+                                              task_reduce_quotient));
+            CHAN_OUT1(digit_t, product[i], r, SELF_OUT_CH(task_reduce_subtract));
         } else {
-            n = 0;
-            // TODO: could break out of the loop  in this case (after CHAN_OUT)
+            // For calling the print task we need to proxy to it values that we do not modify
+            r = *CHAN_IN3(digit_t, product[i],
+                          MC_IN_CH(ch_product, task_mult, task_reduce_subtract),
+                          MC_IN_CH(ch_normalized_product, task_reduce_normalize, task_reduce_subtract),
+                          SELF_IN_CH(task_reduce_subtract));
         }
+        CHAN_OUT1(digit_t, product[i], r, CALL_CH(ch_print_product));
 
-        LOG("reduce: multiply: n[%u]=%x q=%x c=%x m[%u]=%x\r\n",
-               i - offset, n, q, c, i, m);
+        if (d == NUM_DIGITS) // reduction done
+            CHAN_OUT1(digit_t, product[i], r, RET_CH(ch_mult_mod));
+    }
 
-        c = m >> DIGIT_BITS;
-        m &= DIGIT_MASK;
+    len = d;
+    CHAN_OUT1(unsigned, len, len, MC_OUT_CH(ch_reduce_subtract_product, task_reduce_subtract,
+                                  task_reduce_quotient));
+    CHAN_OUT1(unsigned, len, len, CALL_CH(ch_print_product));
 
-        CHAN_OUT1(digit_t, product[i], m, MC_OUT_CH(ch_qn, task_reduce_multiply,
-                                          task_reduce_compare, task_reduce_subtract));
+    if (d > NUM_DIGITS) {
+        const task_t *next_task = TASK_REF(task_reduce_quotient);  
+        CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_print_product));
+    } else { // reduction finished: exit from the reduce hypertask (after print)
+        LOG_DEBUG("reduce: subtract: reduction done\r\n");
 
-        CHAN_OUT1(digit_t, product[i], m, CALL_CH(ch_print_product));
+        // TODO: Is it ok to get the next task directly from call channel?
+        //       If not, all we have to do is have reduce task proxy it.
+        //       Also, do we need a dedicated epilogue task?
+        const task_t *next_task = *CHAN_IN1(task_t *, next_task, CALL_CH(ch_mult_mod));
+        CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_print_product));
     }
-    const task_t *next_task =TASK_REF(task_reduce_compare);  
-    CHAN_OUT1(task_t *, next_task, next_task , CALL_CH(ch_print_product));
+
     TRANSITION_TO(task_print_product);
 }
 
-void task_reduce_compare()
+#if CONFIG_REDUCE == REDUCE_MONTGOMERY
+// Montgomery reduction (REDC) of the 2k-digit product: P * R^-1 mod N.
+//
+// Each instance handles one digit d of the product (d = 0..k-1): it adds
+// u * N * b^d, with u = P[d] * n' mod b, which zeroes P[d]. Only the window
+// P[d..d+k] is touched; the carry out of the top of the window is deferred to
+// the next instance, which adds it one digit higher. After k steps the result
+// is P[k..2k-1] (plus the deferred carry) and is below 2N.
+void task_mont_reduce()
 {
     int i;
-    digit_t m, qn;
-    char relation = '=';
+    digit_t m, u, n_prime;
+    ddigit_t s, c, carry;
+    digit_t t[MAX_DIGITS + 1]; // window P[d+1..d+k] and the carry above it
+    digit_t n[MAX_DIGITS];
+    unsigned d;
 
 #ifdef SHOW_PROGRESS_ON_LED
     blink(1, BLINK_DURATION_TASK, LED2);
 #endif
 
-    LOG("reduce: compare\r\n");
+    d = *CHAN_IN2(unsigned, digit, CH(task_mult, task_mont_reduce),
+                                   SELF_IN_CH(task_mont_reduce));
+    carry = *CHAN_IN2(ddigit_t, carry, CH(task_mult, task_mont_reduce),
+                                       SELF_IN_CH(task_mont_reduce));
+    n_prime = *CHAN_IN1(digit_t, n_prime, MC_IN_CH(ch_n_prime, task_init, task_mont_reduce));
 
-    // TODO: could transform this loop into a self-edge
-    // TODO: this loop might not have to go down to zero, but to NUM_DIGITS
-    // TODO: consider adding number of digits to go along with the 'product' field
-    for (i = NUM_DIGITS * 2 - 1; i >= 0; --i) {
-        m = *CHAN_IN3(digit_t, product[i],
-                      MC_IN_CH(ch_product, task_mult, task_reduce_compare),
-                      MC_IN_CH(ch_normalized_product, task_reduce_normalize, task_reduce_compare),
-                      // TODO: do we need 'ch_reduce_add_product' here? We do not if
-                      // the 'task_reduce_subtract' overwrites all values written by
-                      // 'task_reduce_add', which, I think, is the case.
-                      MC_IN_CH(ch_reduce_subtract_product, task_reduce_subtract,
-                               task_reduce_compare));
-        qn = *CHAN_IN1(digit_t, product[i],
-                       MC_IN_CH(ch_qn, task_reduce_multiply, task_reduce_compare));
-
-        LOG("reduce: compare: m[%u]=%x qn[%u]=%x\r\n", i, m, i, qn);
-
-        if (m > qn) {
-            relation = '>';
-            break;
-        } else if (m < qn) {
-            relation = '<';
-            break;
-        }
-    }
+    LOG_DEBUG("mont reduce: d=%u carry=%u\r\n", d, carry);
 
-    LOG("reduce: compare: relation %c\r\n", relation);
+    c = 0;
+    for (i = 0; i < NUM_DIGITS; ++i) {
+        m = *CHAN_IN2(digit_t, product[d + i],
+                      MC_IN_CH(ch_product, task_mult, task_mont_reduce),
+                      SELF_IN_CH(task_mont_reduce));
+        n[i] = *CHAN_IN1(digit_t, N[i], MC_IN_CH(ch_modulus, task_init, task_mont_reduce));
 
-    if (relation == '<') {
-        TRANSITION_TO(task_reduce_add);
-    } else {
-        TRANSITION_TO(task_reduce_subtract);
+        if (i == 0)
+            u = MULT_DIGITS(m, n_prime) & DIGIT_MASK;
+
+        s = m + MULT_DIGITS(u, n[i]) + c;
+        c = s >> DIGIT_BITS;
+        if (i > 0) // digit d is zero by choice of u
+            t[i - 1] = s & DIGIT_MASK;
+
+        LOG_TRACE("mont reduce: m[%u]=%x n[%u]=%x u=%x s=%x\r\n", d + i, m, i, n[i], u, s);
     }
-}
 
-// TODO: this addition and subtraction can probably be collapsed
-// into one loop that always subtracts the digits, but, conditionally, also
-// adds depending on the result from the 'compare' task. For now,
-// we keep them separate for clarity.
+    m = *CHAN_IN2(digit_t, product[d + NUM_DIGITS],
+                  MC_IN_CH(ch_product, task_mult, task_mont_reduce),
+                  SELF_IN_CH(task_mont_reduce));
+    s = m + c + carry;
+    t[NUM_DIGITS - 1] = s & DIGIT_MASK;
+    t[NUM_DIGITS] = carry = s >> DIGIT_BITS;
+
+    d++;
+
+    if (d < NUM_DIGITS) {
+        for (i = 0; i < NUM_DIGITS; ++i)
+            CHAN_OUT1(digit_t, product[d + i], t[i], SELF_OUT_CH(task_mont_reduce));
+        CHAN_OUT1(unsigned, digit, d, SELF_OUT_CH(task_mont_reduce));
+        CHAN_OUT1(ddigit_t, carry, carry, SELF_OUT_CH(task_mont_reduce));
+        TRANSITION_TO(task_mont_reduce);
+    }
+
+    sub_n_if_ge(t, n, NUM_DIGITS);
+
+    for (i = 0; i < NUM_DIGITS; ++i)
+        CHAN_OUT1(digit_t, product[i], t[i], RET_CH(ch_mult_mod));
+
+    LOG_DEBUG("mont reduce: reduction done\r\n");
+
+    const task_t *next_task = *CHAN_IN1(task_t *, next_task, CALL_CH(ch_mult_mod));
+    transition_to(next_task);
+}
 
-void task_reduce_add()
+#if CONFIG_MONT_CIOS
+// Montgomery multiplication with interleaved reduction (CIOS): A * B * R^-1 mod N
+//
+// Each instance handles one digit a = A[i]: it accumulates a * B into the
+// running sum T and immediately applies one REDC step, T = (T + u * N) / b,
+// with u = T[0] * n' mod b. T stays below 2N, so it fits in k+1 digits and
+// the 2k-digit product is never formed.
+void task_mont_mult()
 {
-    int i, j;
-    digit_t m, n, c, r;
-    unsigned d, offset;
+    int j;
+    digit_t a, b, n_prime;
+    ddigit_t s, c;
+    digit_t t[MAX_DIGITS + 2];
+    digit_t n[MAX_DIGITS];
+    unsigned i, k = NUM_DIGITS; // the bound of every loop, read once
 
 #ifdef SHOW_PROGRESS_ON_LED
-    blink(1, BLINK_DURATION_TASK, LED2);
+    blink(1, BLINK_DURATION_TASK / 4, LED1);
 #endif
 
-    d = *CHAN_IN1(unsigned, digit, MC_IN_CH(ch_reduce_digit,
-                                  task_reduce_quotient, task_reduce_compare));
-
-    // Part of this task is to shift modulus by radix^(digit - NUM_DIGITS)
-    offset = d - NUM_DIGITS;
+    i = *CHAN_IN2(unsigned, digit, CH(task_mult_mod, task_mont_mult),
+                                   SELF_IN_CH(task_mont_mult));
+    n_prime = *CHAN_IN1(digit_t, n_prime, MC_IN_CH(ch_n_prime, task_init, task_mont_mult));
+    a = *CHAN_IN1(digit_t, A[i], CALL_CH(ch_mult_mod));
 
-    LOG("reduce: add: d=%u offset=%u\r\n", d, offset);
+    LOG_DEBUG("mont mult: i=%u a=%x\r\n", i, a);
 
-    // For calling the print task we need to proxy to it values that
-    // we do not modify
-    for (i = 0; i < offset; ++i) {
-        digit_t tmp = 0; 
-        CHAN_OUT1(digit_t, product[i], tmp, CALL_CH(ch_print_product));
+    // T += a * B (on the first digit, T starts out as zero)
+    c = 0;
+    for (j = 0; j < k; ++j) {
+        b = *CHAN_IN1(digit_t, B[j], CALL_CH(ch_mult_mod));
+        s = (i > 0) ? *CHAN_IN1(digit_t, acc[j], SELF_IN_CH(task_mont_mult)) : 0;
+        s += MULT_DIGITS(a, b) + c;
+        t[j] = s & DIGIT_MASK;
+        c = s >> DIGIT_BITS;
     }
-
-    // For calling the print task we need to proxy to it values that
-    // we do not modify
-    for (i = 0; i < offset; ++i) {
-        digit_t tmp = 0; 
-        CHAN_OUT1(digit_t, product[i], tmp, CALL_CH(ch_print_product));
+    s = (i > 0) ? *CHAN_IN1(digit_t, acc[k], SELF_IN_CH(task_mont_mult)) : 0;
+    s += c;
+    t[k] = s & DIGIT_MASK;
+    t[k + 1] = s >> DIGIT_BITS;
+
+    // T = (T + u * N) / b. Digit 0 of N is loaded outside the loop, for the
+    // compiler to see that it is set when k is read at run time.
+    n[0] = *CHAN_IN1(digit_t, N[0], MC_IN_CH(ch_modulus, task_init, task_mont_mult));
+    for (j = 1; j < k; ++j)
+        n[j] = *CHAN_IN1(digit_t, N[j], MC_IN_CH(ch_modulus, task_init, task_mont_mult));
+    mont_redc_step(t, n, n_prime, k);
+
+    i++;
+
+    if (i < k) {
+        for (j = 0; j <= k; ++j)
+            CHAN_OUT1(digit_t, acc[j], t[j], SELF_OUT_CH(task_mont_mult));
+        CHAN_OUT1(unsigned, digit, i, SELF_OUT_CH(task_mont_mult));
+        TRANSITION_TO(task_mont_mult);
     }
 
-    // TODO: coult transform this loop into a self-edge
-    c = 0;
-    for (i = offset; i < 2 * NUM_DIGITS; ++i) {
-        m = *CHAN_IN3(digit_t, product[i],
-                      MC_IN_CH(ch_product, task_mult, task_reduce_add),
-                      MC_IN_CH(ch_normalized_product, task_reduce_normalize, task_reduce_add),
-                      MC_IN_CH(ch_reduce_subtract_product,
-                               task_reduce_subtract, task_reduce_add));
+    sub_n_if_ge(t, n, k);
+
+    for (j = 0; j < k; ++j)
+        CHAN_OUT1(digit_t, product[j], t[j], RET_CH(ch_mult_mod));
+
+    LOG_DEBUG("mont mult: done\r\n");
 
-        // Shifted index of the modulus digit
-        j = i - offset;
+    const task_t *next_task = *CHAN_IN1(task_t *, next_task, CALL_CH(ch_mult_mod));
+    transition_to(next_task);
+}
+
+// Montgomery squaring with interleaved reduction: A^2 * R^-1 mod N
+//
+// Same as task_mont_mult with B = A, except that each instance adds only
+// the products on and above the diagonal, A[i]^2 + 2 * A[i] * A[j] for
+// j > i. Every digit of T that the REDC step consumes has already received
+// all of its products, because products A[r] * A[s] with r <= s are added by
+// instance r. The doubled products do not fit in a double digit, so they are
+// split into a low digit and a high part of up to DIGIT_BITS + 1 bits.
+void task_mont_sqr()
+{
+    int j;
+    digit_t a, b, n_prime;
+    ddigit_t s, c, dp;
+    digit_t t[MAX_DIGITS + 2];
+    digit_t n[MAX_DIGITS];
+    unsigned i, k = NUM_DIGITS; // the bound of every loop, read once
+
+#ifdef SHOW_PROGRESS_ON_LED
+    blink(1, BLINK_DURATION_TASK / 4, LED1);
+#endif
 
-        if (i < offset + NUM_DIGITS) {
-            n = *CHAN_IN1(digit_t, N[j], MC_IN_CH(ch_modulus, task_init, task_reduce_add));
+    i = *CHAN_IN2(unsigned, digit, CH(task_sqr_mod, task_mont_sqr),
+                                   SELF_IN_CH(task_mont_sqr));
+    n_prime = *CHAN_IN1(digit_t, n_prime, MC_IN_CH(ch_n_prime, task_init, task_mont_sqr));
+    a = *CHAN_IN1(digit_t, A[i], CALL_CH(ch_sqr_mod));
+
+    LOG_DEBUG("mont sqr: i=%u a=%x\r\n", i, a);
+
+    // T += A[i]^2 * b^i + 2 * A[i] * A[j] * b^j (j > i)
+    c = 0;
+    for (j = 0; j < k; ++j) {
+        s = (i > 0) ? *CHAN_IN1(digit_t, acc[j], SELF_IN_CH(task_mont_sqr)) : 0;
+        s += c;
+        if (j < i) {
+            c = 0; // nothing to add below the diagonal, so no carry either
+        } else if (j == i) {
+            s += MULT_DIGITS(a, a);
+            c = s >> DIGIT_BITS;
         } else {
-            n = 0;
-            j = 0; // a bit ugly, we want 'nan', but ok, since for output only
-            // TODO: could break out of the loop in this case (after CHAN_OUT)
+            b = *CHAN_IN1(digit_t, A[j], CALL_CH(ch_sqr_mod));
+            dp = MULT_DIGITS(a, b);
+            s += (dp << 1) & DIGIT_MASK;
+            c = (dp >> (DIGIT_BITS - 1)) + (s >> DIGIT_BITS);
         }
+        t[j] = s & DIGIT_MASK;
+    }
+    s = (i > 0) ? *CHAN_IN1(digit_t, acc[k], SELF_IN_CH(task_mont_sqr)) : 0;
+    s += c;
+    t[k] = s & DIGIT_MASK;
+    t[k + 1] = s >> DIGIT_BITS;
+
+    // T = (T + u * N) / b. Digit 0 of N is loaded outside the loop, for the
+    // compiler to see that it is set when k is read at run time.
+    n[0] = *CHAN_IN1(digit_t, N[0], MC_IN_CH(ch_modulus, task_init, task_mont_sqr));
+    for (j = 1; j < k; ++j)
+        n[j] = *CHAN_IN1(digit_t, N[j], MC_IN_CH(ch_modulus, task_init, task_mont_sqr));
+    mont_redc_step(t, n, n_prime, k);
+
+    i++;
+
+    if (i < k) {
+        for (j = 0; j <= k; ++j)
+            CHAN_OUT1(digit_t, acc[j], t[j], SELF_OUT_CH(task_mont_sqr));
+        CHAN_OUT1(unsigned, digit, i, SELF_OUT_CH(task_mont_sqr));
+        TRANSITION_TO(task_mont_sqr);
+    }
 
-        r = c + m + n;
+    sub_n_if_ge(t, n, k);
 
-        LOG("reduce: add: m[%u]=%x n[%u]=%x c=%x r=%x\r\n", i, m, j, n, c, r);
+    for (j = 0; j < k; ++j)
+        CHAN_OUT1(digit_t, product[j], t[j], RET_CH(ch_mult_mod));
 
-        c = r >> DIGIT_BITS;
-        r &= DIGIT_MASK;
+    LOG_DEBUG("mont sqr: done\r\n");
 
-        CHAN_OUT1(digit_t, product[i], r, CH(task_reduce_add, task_reduce_subtract));
-        CHAN_OUT1(digit_t, product[i], r, CALL_CH(ch_print_product));
-    }
-    const task_t *next_task =TASK_REF(task_reduce_subtract);  
-    CHAN_OUT1(task_t *, next_task, next_task , CALL_CH(ch_print_product));
-    TRANSITION_TO(task_print_product);
+    const task_t *next_task = *CHAN_IN1(task_t *, next_task, CALL_CH(ch_sqr_mod));
+    transition_to(next_task);
 }
-
-// TODO: re-use task_reduce_normalize?
-void task_reduce_subtract()
+#endif // CONFIG_MONT_CIOS
+#elif CONFIG_REDUCE == REDUCE_BARRETT
+// Barrett reduction of the 2k-digit product X, first step: the quotient
+// estimate q = floor(floor(X / b^(k-1)) * mu / b^(k+1)).
+//
+// Each instance computes one column j of the product floor(X / b^(k-1)) * mu,
+// like task_mult does. Columns below k-1 are skipped: the carry they would
+// contribute can lower the estimate by at most one, which the final correction
+// absorbs. Columns k+1 and up are the digits of q.
+void task_barrett_quotient()
 {
     int i;
-    digit_t m, s, r, qn;
-    unsigned d, borrow, offset;
+    digit_t a, b;
+    ddigit_t c, dp, p, carry;
+    unsigned digit;
 
 #ifdef SHOW_PROGRESS_ON_LED
     blink(1, BLINK_DURATION_TASK, LED2);
 #endif
 
-    d = *CHAN_IN1(unsigned, digit, MC_IN_CH(ch_reduce_digit, task_reduce_quotient,
-                                  task_reduce_subtract));
+    digit = *CHAN_IN2(unsigned, digit, CH(task_mult, task_barrett_quotient),
+                                       SELF_IN_CH(task_barrett_quotient));
+    carry = *CHAN_IN2(ddigit_t, carry, CH(task_mult, task_barrett_quotient),
+                                       SELF_IN_CH(task_barrett_quotient));
 
-    // The qn product had been shifted by this offset, no need to subtract the zeros
-    offset = d - NUM_DIGITS;
+    LOG_DEBUG("barrett quotient: digit=%u carry=%x\r\n", digit, carry);
 
-    LOG("reduce: subtract: d=%u offset=%u\r\n", d, offset);
+    // X / b^(k-1) and mu have k+1 digits each
+    p = carry;
+    c = 0;
+    for (i = 0; i <= NUM_DIGITS; ++i) {
+        if (digit - i <= NUM_DIGITS) { // wraps around when i > digit
+            a = *CHAN_IN1(digit_t, product[NUM_DIGITS - 1 + digit - i],
+                          MC_IN_CH(ch_product, task_mult, task_barrett_quotient));
+            b = *CHAN_IN1(digit_t, mu[i], CH(task_init, task_barrett_quotient));
+            dp = MULT_DIGITS(a, b);
 
-    // For calling the print task we need to proxy to it values that
-    // we do not modify
-    for (i = 0; i < offset; ++i) {
-        m = *CHAN_IN4(digit_t, product[i],
-                      MC_IN_CH(ch_product, task_mult, task_reduce_subtract),
-                      MC_IN_CH(ch_normalized_product, task_reduce_normalize, task_reduce_subtract),
-                      CH(task_reduce_add, task_reduce_subtract),
-                      SELF_IN_CH(task_reduce_subtract));
-        digit_t tmp = 0; 
-        CHAN_OUT1(digit_t, product[i], tmp, CALL_CH(ch_print_product));
+            c += dp >> DIGIT_BITS;
+            p += dp & DIGIT_MASK;
+        }
     }
 
-    // TODO: could transform this loop into a self-edge
-    borrow = 0;
-    for (i = 0; i < 2 * NUM_DIGITS; ++i) {
-        m = *CHAN_IN4(digit_t, product[i],
-                      MC_IN_CH(ch_product, task_mult, task_reduce_subtract),
-                      MC_IN_CH(ch_normalized_product, task_reduce_normalize, task_reduce_subtract),
-                      CH(task_reduce_add, task_reduce_subtract),
-                      SELF_IN_CH(task_reduce_subtract));
+    c += p >> DIGIT_BITS;
+    p &= DIGIT_MASK;
 
-        // For calling the print task we need to proxy to it values that we do not modify
-        if (i >= offset) {
-            qn = *CHAN_IN1(digit_t, product[i],
-                           MC_IN_CH(ch_qn, task_reduce_multiply, task_reduce_subtract));
+    if (digit > NUM_DIGITS) {
+        LOG_TRACE("barrett quotient: q[%u]=%x\r\n", digit - NUM_DIGITS - 1, p);
+        CHAN_OUT1(digit_t, quotient[digit - NUM_DIGITS - 1], p,
+                  CH(task_barrett_quotient, task_barrett_multiply));
+    }
 
-            s = qn + borrow;
-            if (m < s) {
-                m += 1 << DIGIT_BITS;
-                borrow = 1;
-            } else {
-                borrow = 0;
-            }
-            r = m - s;
+    digit++;
 
-            LOG("reduce: subtract: m[%u]=%x qn[%u]=%x b=%u r=%x\r\n",
-                   i, m, i, qn, borrow, r);
+    if (digit <= 2 * NUM_DIGITS + 1) {
+        CHAN_OUT1(ddigit_t, carry, c, SELF_OUT_CH(task_barrett_quotient));
+        CHAN_OUT1(unsigned, digit, digit, SELF_OUT_CH(task_barrett_quotient));
+        TRANSITION_TO(task_barrett_quotient);
+    }
 
-            CHAN_OUT1(digit_t, product[i], r, MC_OUT_CH(ch_reduce_subtract_product, task_reduce_subtract,
-                                              task_reduce_quotient, task_reduce_compare));
-            CHAN_OUT1(digit_t, product[i], r, SELF_OUT_CH(task_reduce_subtract));
-        } else {
-            r = m;
-        }
-        CHAN_OUT1(digit_t, product[i], r, CALL_CH(ch_print_product));
+    unsigned zero = 0;
+    ddigit_t no_carry = 0;
+    CHAN_OUT1(unsigned, digit, zero, CH(task_barrett_quotient, task_barrett_multiply));
+    CHAN_OUT1(ddigit_t, carry, no_carry, CH(task_barrett_quotient, task_barrett_multiply));
+    CHAN_OUT1(unsigned, borrow, zero, CH(task_barrett_quotient, task_barrett_multiply));
+    TRANSITION_TO(task_barrett_multiply);
+}
 
-        if (d == NUM_DIGITS) // reduction done
-            CHAN_OUT1(digit_t, product[i], r, RET_CH(ch_mult_mod));
+// Second step: R = X - q * N mod b^(k+1). The true remainder is below 4N, so
+// it fits in k+1 digits and only the low k+1 columns of q * N are needed.
+// Each instance computes one column and subtracts it from X right away.
+void task_barrett_multiply()
+{
+    int i;
+    digit_t r;
+    ddigit_t c, dp, p, m, s, carry;
+    unsigned digit, borrow;
+
+#ifdef SHOW_PROGRESS_ON_LED
+    blink(1, BLINK_DURATION_TASK, LED2);
+#endif
+
+    digit = *CHAN_IN2(unsigned, digit, CH(task_barrett_quotient, task_barrett_multiply),
+                                       SELF_IN_CH(task_barrett_multiply));
+    carry = *CHAN_IN2(ddigit_t, carry, CH(task_barrett_quotient, task_barrett_multiply),
+                                       SELF_IN_CH(task_barrett_multiply));
+    borrow = *CHAN_IN2(unsigned, borrow, CH(task_barrett_quotient, task_barrett_multiply),
+                                         SELF_IN_CH(task_barrett_multiply));
+
+    LOG_DEBUG("barrett multiply: digit=%u carry=%x borrow=%u\r\n", digit, carry, borrow);
+
+    p = carry;
+    c = 0;
+    for (i = 0; i <= digit && i < NUM_DIGITS; ++i) {
+        dp = MULT_DIGITS(*CHAN_IN1(digit_t, N[i],
+                                   MC_IN_CH(ch_modulus, task_init, task_barrett_multiply)),
+                         *CHAN_IN1(digit_t, quotient[digit - i],
+                                   CH(task_barrett_quotient, task_barrett_multiply)));
+
+        c += dp >> DIGIT_BITS;
+        p += dp & DIGIT_MASK;
     }
 
-    if (d > NUM_DIGITS) {
-        const task_t *next_task = TASK_REF(task_reduce_quotient);  
-        CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_print_product));
-    } else { // reduction finished: exit from the reduce hypertask (after print)
-        LOG("reduce: subtract: reduction done\r\n");
+    c += p >> DIGIT_BITS;
+    p &= DIGIT_MASK;
 
-        // TODO: Is it ok to get the next task directly from call channel?
-        //       If not, all we have to do is have reduce task proxy it.
-        //       Also, do we need a dedicated epilogue task?
-        const task_t *next_task = *CHAN_IN1(task_t *, next_task, CALL_CH(ch_mult_mod));
-        CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_print_product));
+    m = *CHAN_IN1(digit_t, product[digit], MC_IN_CH(ch_product, task_mult, task_barrett_multiply));
+    s = p + borrow;
+    if (m < s) {
+        m += DIGIT_BASE;
+        borrow = 1;
+    } else {
+        borrow = 0;
     }
+    r = m - s;
 
-    TRANSITION_TO(task_print_product);
+    LOG_DEBUG("barrett multiply: qn[%u]=%x r[%u]=%x\r\n", digit, p, digit, r);
+
+    CHAN_OUT1(digit_t, product[digit], r, CH(task_barrett_multiply, task_barrett_correct));
+
+    digit++;
+
+    if (digit <= NUM_DIGITS) {
+        CHAN_OUT1(unsigned, digit, digit, SELF_OUT_CH(task_barrett_multiply));
+        CHAN_OUT1(ddigit_t, carry, c, SELF_OUT_CH(task_barrett_multiply));
+        CHAN_OUT1(unsigned, borrow, borrow, SELF_OUT_CH(task_barrett_multiply));
+        TRANSITION_TO(task_barrett_multiply);
+    }
+
+    TRANSITION_TO(task_barrett_correct);
+}
+
+// Last step: the estimate q is short of the true quotient by at most two from
+// the floors and one more from the skipped columns, so R is brought into
+// [0, N) by a few subtractions of N (rarely more than one in practice).
+void task_barrett_correct()
+{
+    int i;
+    digit_t r[MAX_DIGITS + 1], n[MAX_DIGITS];
+
+    for (i = 0; i <= NUM_DIGITS; ++i)
+        r[i] = *CHAN_IN1(digit_t, product[i], CH(task_barrett_multiply, task_barrett_correct));
+    for (i = 0; i < NUM_DIGITS; ++i)
+        n[i] = *CHAN_IN1(digit_t, N[i], MC_IN_CH(ch_modulus, task_init, task_barrett_correct));
+
+    while (sub_n_if_ge(r, n, NUM_DIGITS))
+        LOG_DEBUG("barrett correct: subtracted N\r\n");
+
+    for (i = 0; i < NUM_DIGITS; ++i)
+        CHAN_OUT1(digit_t, product[i], r[i], RET_CH(ch_mult_mod));
+
+    LOG_DEBUG("barrett correct: reduction done\r\n");
+
+    const task_t *next_task = *CHAN_IN1(task_t *, next_task, CALL_CH(ch_mult_mod));
+    transition_to(next_task);
 }
+#endif // CONFIG_REDUCE
 
 // TODO: eliminate from control graph when not verbose
 void task_print_product()
@@ -1299,12 +4825,16 @@ void task_print_product()
     int i;
     digit_t m;
 
-    LOG("print: P=");
+    unsigned len;
+
+    len = *CHAN_IN1(unsigned, len, CALL_CH(ch_print_product));
+
+    LOG_TRACE("print: P=");
     for (i = (NUM_DIGITS * 2) - 1; i >= 0; --i) {
-        m = *CHAN_IN1(digit_t, product[i], CALL_CH(ch_print_product));
-        LOG("%x ", m);
+        m = (i < len) ? *CHAN_IN1(digit_t, product[i], CALL_CH(ch_print_product)) : 0;
+        LOG_TRACE("%x ", m);
     }
-    LOG("\r\n");
+    LOG_TRACE("\r\n");
 #endif
 
     next_task = *CHAN_IN1(task_t *, next_task, CALL_CH(ch_print_product));
@@ -0,0 +1,99 @@
+// Known-answer tests of the ChaCha20 block function of src/chacha.c, with
+// the test vectors of RFC 8439, on the host: make -C test check
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../src/chacha.h"
+
+// 2.3.2: key 00 01 .. 1f, counter 1, nonce 00:00:00:09:00:00:00:4a:00:00:00:00
+static const uint8_t block_2_3_2[CHACHA_BLOCK_BYTES] = {
+    0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15, 0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4,
+    0xc7, 0xd1, 0xf4, 0xc7, 0x33, 0xc0, 0x68, 0x03, 0x04, 0x22, 0xaa, 0x9a, 0xc3, 0xd4, 0x6c, 0x4e,
+    0xd2, 0x82, 0x64, 0x46, 0x07, 0x9f, 0xaa, 0x09, 0x14, 0xc2, 0xd7, 0x05, 0xd9, 0x8b, 0x02, 0xa2,
+    0xb5, 0x12, 0x9c, 0xd1, 0xde, 0x16, 0x4e, 0xb9, 0xcb, 0xd0, 0x83, 0xe8, 0xa2, 0x50, 0x3c, 0x4e,
+};
+
+// A.1, test vectors 1 and 2: all-zero key and nonce, counter 0 and 1
+static const uint8_t block_a_1_1[CHACHA_BLOCK_BYTES] = {
+    0x76, 0xb8, 0xe0, 0xad, 0xa0, 0xf1, 0x3d, 0x90, 0x40, 0x5d, 0x6a, 0xe5, 0x53, 0x86, 0xbd, 0x28,
+    0xbd, 0xd2, 0x19, 0xb8, 0xa0, 0x8d, 0xed, 0x1a, 0xa8, 0x36, 0xef, 0xcc, 0x8b, 0x77, 0x0d, 0xc7,
+    0xda, 0x41, 0x59, 0x7c, 0x51, 0x57, 0x48, 0x8d, 0x77, 0x24, 0xe0, 0x3f, 0xb8, 0xd8, 0x4a, 0x37,
+    0x6a, 0x43, 0xb8, 0xf4, 0x15, 0x18, 0xa1, 0x1c, 0xc3, 0x87, 0xb6, 0x69, 0xb2, 0xee, 0x65, 0x86,
+};
+static const uint8_t block_a_1_2[CHACHA_BLOCK_BYTES] = {
+    0x9f, 0x07, 0xe7, 0xbe, 0x55, 0x51, 0x38, 0x7a, 0x98, 0xba, 0x97, 0x7c, 0x73, 0x2d, 0x08, 0x0d,
+    0xcb, 0x0f, 0x29, 0xa0, 0x48, 0xe3, 0x65, 0x69, 0x12, 0xc6, 0x53, 0x3e, 0x32, 0xee, 0x7a, 0xed,
+    0x29, 0xb7, 0x21, 0x76, 0x9c, 0xe6, 0x4e, 0x43, 0xd5, 0x71, 0x33, 0xb0, 0x74, 0xd8, 0x39, 0xd5,
+    0x31, 0xed, 0x1f, 0x28, 0x51, 0x0a, 0xfb, 0x45, 0xac, 0xe1, 0x0a, 0x1f, 0x4b, 0x79, 0x4d, 0x6f,
+};
+
+// 2.4.2: key 00 01 .. 1f, counter 1, nonce 00:00:00:00:00:00:00:4a:00:00:00:00
+static const char plaintext_2_4_2[] =
+    "Ladies and Gentlemen of the class of '99: If I could offer you only one "
+    "tip for the future, sunscreen would be it.";
+static const uint8_t cyphertext_2_4_2[sizeof(plaintext_2_4_2) - 1] = {
+    0x6e, 0x2e, 0x35, 0x9a, 0x25, 0x68, 0xf9, 0x80, 0x41, 0xba, 0x07, 0x28, 0xdd, 0x0d, 0x69, 0x81,
+    0xe9, 0x7e, 0x7a, 0xec, 0x1d, 0x43, 0x60, 0xc2, 0x0a, 0x27, 0xaf, 0xcc, 0xfd, 0x9f, 0xae, 0x0b,
+    0xf9, 0x1b, 0x65, 0xc5, 0x52, 0x47, 0x33, 0xab, 0x8f, 0x59, 0x3d, 0xab, 0xcd, 0x62, 0xb3, 0x57,
+    0x16, 0x39, 0xd6, 0x24, 0xe6, 0x51, 0x52, 0xab, 0x8f, 0x53, 0x0c, 0x35, 0x9f, 0x08, 0x61, 0xd8,
+    0x07, 0xca, 0x0d, 0xbf, 0x50, 0x0d, 0x6a, 0x61, 0x56, 0xa3, 0x8e, 0x08, 0x8a, 0x22, 0xb6, 0x5e,
+    0x52, 0xbc, 0x51, 0x4d, 0x16, 0xcc, 0xf8, 0x06, 0x81, 0x8c, 0xe9, 0x1a, 0xb7, 0x79, 0x37, 0x36,
+    0x5a, 0xf9, 0x0b, 0xbf, 0x74, 0xa3, 0x5b, 0xe6, 0xb4, 0x0b, 0x8e, 0xed, 0xf2, 0x78, 0x5e, 0x42,
+    0x87, 0x4d,
+};
+
+static int failures;
+
+static void check(const char *name, const uint8_t *got, const uint8_t *expected, unsigned len)
+{
+    unsigned i;
+
+    for (i = 0; i < len && got[i] == expected[i]; ++i);
+    if (i < len) {
+        printf("FAIL %s: byte %u is 0x%02x, expected 0x%02x\n", name, i, got[i], expected[i]);
+        ++failures;
+    } else {
+        printf("ok   %s\n", name);
+    }
+}
+
+// XOR of the keystream from the given counter on, as task_chacha does it
+static void chacha_xor(uint8_t *out, const uint8_t *in, unsigned len, const uint8_t *key,
+                       uint32_t counter, const uint8_t *nonce)
+{
+    unsigned i;
+    uint8_t keystream[CHACHA_BLOCK_BYTES];
+
+    for (i = 0; i < len; ++i) {
+        if (i % CHACHA_BLOCK_BYTES == 0)
+            chacha_block(keystream, key, counter + i / CHACHA_BLOCK_BYTES, nonce);
+        out[i] = in[i] ^ keystream[i % CHACHA_BLOCK_BYTES];
+    }
+}
+
+int main()
+{
+    unsigned i;
+    uint8_t key[CHACHA_KEY_BYTES], out[sizeof(plaintext_2_4_2)];
+    uint8_t nonce[CHACHA_NONCE_BYTES] = { 0 };
+
+    memset(key, 0, sizeof(key));
+    chacha_block(out, key, 0, nonce);
+    check("A.1 #1", out, block_a_1_1, CHACHA_BLOCK_BYTES);
+    chacha_block(out, key, 1, nonce);
+    check("A.1 #2", out, block_a_1_2, CHACHA_BLOCK_BYTES);
+
+    for (i = 0; i < sizeof(key); ++i)
+        key[i] = i;
+    nonce[3] = 0x09;
+    nonce[7] = 0x4a;
+    chacha_block(out, key, 1, nonce);
+    check("2.3.2", out, block_2_3_2, CHACHA_BLOCK_BYTES);
+
+    nonce[3] = 0;
+    chacha_xor(out, (const uint8_t *)plaintext_2_4_2, sizeof(cyphertext_2_4_2), key, 1, nonce);
+    check("2.4.2", out, cyphertext_2_4_2, sizeof(cyphertext_2_4_2));
+
+    return failures ? 1 : 0;
+}